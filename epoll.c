@@ -1,3 +1,5 @@
+#define _GNU_SOURCE // CPU affinity (sched_setaffinity, CPU_SET)
+
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
@@ -9,33 +11,303 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h> // Add this to use the time function
+#include <signal.h> // Add this to ignore SIGPIPE when the peer has gone away
+#include <stdint.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h> // TCP_NODELAY for the benchmark connections
+#include <sys/timerfd.h> // Nanosecond wakeups for the benchmark schedule
+#include <pthread.h> // Benchmark threads
+#include <stdatomic.h> // Lock-free accept handoff queues
+#include <sys/resource.h> // getrusage() for the CPU time of a benchmark, RLIMIT_NOFILE
+#include <sys/eventfd.h> // Wake up every worker on shutdown
+#include <sched.h> // Pin workers to CPUs
+#include <sys/syscall.h>
+#include <linux/mempolicy.h> // MPOL_LOCAL for NUMA-local worker memory
+#include <linux/filter.h> // Classic BPF program for SO_ATTACH_REUSEPORT_CBPF
+#include <poll.h> // poll() reactor backend
+#include <sys/mman.h>
+#include <linux/io_uring.h> // io_uring reactor backend, used through the raw system calls
+#include <linux/perf_event.h> // Hardware counters of the event loop (--perf-counters)
+#include <sys/ioctl.h>
 
 // Add these to avoid the warning of implicit declaration
 #include <arpa/inet.h>
 #include <getopt.h>
+#include <stdarg.h> // buffer_printf() for the admin endpoint
+#include <stddef.h> // offsetof()
+#include <limits.h> // PATH_MAX
+
+#include "trace.h" // Binary event trace records, shared with trace2json
 
 #define DEFAULT_ADDR    INADDR_ANY // Server Address (0.0.0.0 default)
 #define DEFAULT_PORT    9090       // Server Port Number
-#define MAX_CONN        16         // Maximum number of clients
-#define MAX_EVENTS      32         // Maximum number of epoll listen-on events
-#define BUF_SIZE        16         // Maximum size of server I/O buffer
+#define DEFAULT_WINDOW  64         // Default number of outstanding client requests
+#define DEFAULT_BACKLOG 16         // Default listen() backlog of the server (--backlog)
+#define DEFAULT_EVENTS  32         // Default epoll_wait() batch size of the server (--events)
+#define DEFAULT_READ_SIZE 16       // Default size of a server read() (--read-size)
+#define DEFAULT_INBOX   4096       // Default capacity of a worker's accept handoff queue (--inbox)
+#define DEFAULT_URING_BUFFERS 1024 // Default receive buffers per worker of io_uring-fixed (--uring-buffers)
+#define TOP_CONNS       32         // Busiest connections tracked per worker for the admin endpoint
+#define TOP_WINDOW_NS   1000000000 // Interval the busiest connections are ranked over
+#define DEFAULT_TRACE_RECORDS 65536 // Default ring size of a worker's trace file (--trace-records)
+#define MAX_EVENTS      32         // Maximum number of epoll listen-on events of the client
 #define MAX_LINE        256        // Maximum size of client I/O buffer
+#define BUFFER_CHUNK    4096       // Size of the pooled buffers connections hold while they have partial input or pending output
+#define BUFFER_POOL_MAX 1024       // Free malloc()ed buffers a worker keeps for reuse, the rest are freed
+#define DEFAULT_RING_BUFFERS 8192  // Default double-mapped rings a worker can create (--ring-buffers)
+#define DEFAULT_ASYNC_THREADS 2    // Default threads running slow requests off the event loops (--async-threads)
+#define HUGE_PAGE       (2UL << 20) // Size of the huge pages for --huge-pages
+#define MAX_MSG         65536      // Maximum size of a single request message
+#define DEFAULT_DURATION 10        // Default benchmark duration in seconds
+#define DEFAULT_PAYLOAD 16         // Default benchmark request size in bytes
+#define DRAIN_TIMEOUT   2          // Seconds to wait for outstanding responses after a benchmark
+#define MAX_SWEEP       16         // Maximum number of values per sweep dimension
+
+/*
+ * Binary protocol, next to the text one. A connection whose first byte is BIN_MAGIC
+ * (never the start of a text request) speaks it for its whole life. Requests and
+ * responses are a header in network byte order followed by `length` payload bytes,
+ * so nothing is scanned for delimiters. A response carries the opcode and id of its
+ * request, which lets a client match responses to requests without counting them:
+ * admin and sleep requests finish in the async pool, after later requests may have
+ * been answered.
+ */
+#define BIN_MAGIC       0xB1
+#define BIN_ECHO        1  // The payload comes back
+#define BIN_DATE        2  // Payload ignored, the response is the server's date (like %date%)
+#define BIN_TIME        3  // Payload ignored, the response is the server's time (like %time%)
+#define BIN_ADMIN       4  // The payload is an admin endpoint path (/metrics, /connections?n=10), the response its body
+#define BIN_SLEEP       5  // The payload is a 32-bit number of milliseconds, the empty response comes after them
+#define BIN_OK          0  // Response status
+#define BIN_EOPCODE     1  // Unknown opcode, empty payload
+#define BIN_ENOTFOUND   2  // Unknown admin path, the payload says so
+#define BIN_EINVAL      3  // Malformed payload
+#define BIN_EBUSY       4  // Too many requests of the connection are still in the async pool
+
+struct bin_header {
+    uint8_t magic;
+    uint8_t opcode;
+    uint16_t status;  // 0 in requests
+    uint32_t length;  // Payload bytes after the header
+    uint32_t id;      // Chosen by the client, echoed in the response
+};
 
 // set the default address and port number
 in_addr_t address = DEFAULT_ADDR;
 unsigned short port = DEFAULT_PORT;
 
+// set the default number of requests the client keeps in flight
+int window = DEFAULT_WINDOW;
+
+// log every connection and request (disable with -q when benchmarking)
+int verbose = 1;
+
+// benchmark settings of the client (-m selects the benchmark mode)
+struct bench_opts {
+    const char *mode;      // NULL: interactive client, "open"/"pipe": open/closed-loop load, "churn": connect/close,
+                           // "sweep": closed loop over payload x connections x depth
+    int threads;           // Number of benchmark threads
+    double rate;           // Requests per second over all connections (open loop)
+    int poisson;           // Exponential inter-arrival times instead of a constant interval
+    int duration;          // Seconds to generate load
+    int conns;             // Number of connections
+    int payload;           // Request size in bytes, excluding the terminator
+    const char *hist_file; // Write the corrected latency distribution (or the sweep results) here
+    int json;              // Sweep results as JSON instead of CSV
+    const char *payload_list; // Sweep dimensions as given on the command line
+    const char *conns_list;
+    const char *window_list;
+    int binary;            // Send echo requests in the binary protocol (-B)
+} bench = { NULL, 1, 1000, 0, DEFAULT_DURATION, 1, DEFAULT_PAYLOAD, NULL, 0, NULL, NULL, NULL, 0 };
+
+/*
+ * Server settings, from the config file (--config) and long options.
+ * Every key of the config file is also a long option of the same name.
+ */
+struct server_config {
+    int backlog;   // listen() backlog
+    int events;    // epoll_wait() batch size
+    int read_size; // Bytes per read() on client sockets
+    int max_msg;   // Longest request accepted before the connection is dropped
+    int workers;   // Event loop threads, each with its own SO_REUSEPORT listener
+    int rcvbuf;    // SO_RCVBUF set on the listeners (inherited by connections), 0 keeps the kernel default
+    int sndbuf;    // SO_SNDBUF set on the listeners (inherited by connections), 0 keeps the kernel default
+    int nodelay;   // TCP_NODELAY on connections: send small responses without waiting for ACKs
+    int quickack;  // TCP_QUICKACK on connections, re-armed after every read
+    int defer_accept; // TCP_DEFER_ACCEPT seconds: only wake the listener once a request has arrived
+    int fastopen;  // TCP_FASTOPEN queue length of the listeners, 0 disables
+    int rcvlowat;  // SO_RCVLOWAT of connections, only for protocols whose requests are at least that big
+    int incoming_cpu; // Steer connections to the listener of the worker pinned to the receiving CPU
+    int reuseport_cbpf; // Select the listener by receiving CPU with a classic BPF program
+    int accept_mode; // ACCEPT_REUSEPORT, ACCEPT_HANDOFF or ACCEPT_EXCLUSIVE (--accept-mode)
+    int inbox;     // Connections a worker's handoff queue holds, rounded up to a power of two
+    int rebalance_ms; // Interval of the connection rebalancer, 0 disables it
+    int rebalance_skew; // Move connections once the busiest worker is this many percent busier than the idlest
+    int reactor;   // Event loop backend, an index into reactor_names (--reactor)
+    int uring_sqpoll; // io_uring SQ polling thread idle time in milliseconds, 0 disables SQPOLL
+    int uring_sqpoll_cpu; // CPU the SQ polling thread is bound to, -1 leaves it to the scheduler
+    int uring_buffers; // Receive buffers per worker for io_uring-fixed, rounded up to a power of two
+    int admin_port; // Port of the admin (metrics) endpoint, 0 disables it
+    int perf_counters; // Count cycles, instructions, cache and branch misses per request type
+    int trace_records; // Records in each worker's trace ring, rounded up to a power of two
+    int ring_buffers; // Double-mapped ring buffers a worker can create for its connections, 0 disables them
+    int huge_pages; // Back the connection slab and the buffer pools with huge pages
+    int async_threads; // Threads running admin and sleep requests off the event loops, 0 runs them inline
+} cfg = { DEFAULT_BACKLOG, DEFAULT_EVENTS, DEFAULT_READ_SIZE, MAX_MSG, 1, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, DEFAULT_INBOX, 0, 10, 0,
+          0, -1, DEFAULT_URING_BUFFERS, 0, 0, DEFAULT_TRACE_RECORDS, DEFAULT_RING_BUFFERS, 0,
+          DEFAULT_ASYNC_THREADS };
+
+// Trace files are written to <trace_path>.<worker> (--trace, builds with -DEPOLL_TRACE only)
+static char *trace_path = NULL;
+
+// How new connections reach the workers
+#define ACCEPT_REUSEPORT 0 // Every worker accepts on its own SO_REUSEPORT listener
+#define ACCEPT_HANDOFF   1 // One acceptor thread hands connections to the least loaded worker
+#define ACCEPT_EXCLUSIVE 2 // Every worker polls one shared listener with EPOLLEXCLUSIVE
+#define EXCLUSIVE_ACCEPTS 4 // Connections a worker takes per wakeup in exclusive mode, the rest of a burst wakes others
+
+static const char *const accept_modes[] = { "reuseport", "handoff", "exclusive", NULL };
+
+// Event loop backends, see struct reactor_ops
+static const char *const reactor_names[] = { "epoll-et", "epoll-lt", "poll", "io_uring", "io_uring-fixed", NULL };
+
+// CPUs the workers are pinned to (--cpus), worker i runs on cpu_list[i % cpu_count]
+static int *cpu_list = NULL;
+static int cpu_count = 0;
+
+struct config_key {
+    const char *name;
+    int *val;
+    int min;
+    int max;
+};
+
+static const struct config_key config_keys[] = {
+    { "backlog",   &cfg.backlog,   1, 65535 },
+    { "events",    &cfg.events,    1, 65536 },
+    { "read-size", &cfg.read_size, 1, 1 << 24 },
+    { "max-msg",   &cfg.max_msg,   16, 1 << 30 },
+    { "workers",   &cfg.workers,   1, 1024 },
+    { "rcvbuf",    &cfg.rcvbuf,    0, 1 << 30 },
+    { "sndbuf",    &cfg.sndbuf,    0, 1 << 30 },
+    { "nodelay",   &cfg.nodelay,   0, 1 },
+    { "quickack",  &cfg.quickack,  0, 1 },
+    { "defer-accept", &cfg.defer_accept, 0, 3600 },
+    { "fastopen",  &cfg.fastopen,  0, 65535 },
+    { "rcvlowat",  &cfg.rcvlowat,  0, 1 << 30 },
+    { "incoming-cpu", &cfg.incoming_cpu, 0, 1 },
+    { "reuseport-cbpf", &cfg.reuseport_cbpf, 0, 1 },
+    { "inbox",     &cfg.inbox,     1, 1 << 20 },
+    { "rebalance-ms", &cfg.rebalance_ms, 0, 60000 },
+    { "rebalance-skew", &cfg.rebalance_skew, 1, 100 },
+    { "uring-sqpoll", &cfg.uring_sqpoll, 0, 60000 },
+    { "uring-sqpoll-cpu", &cfg.uring_sqpoll_cpu, -1, 4095 },
+    { "uring-buffers", &cfg.uring_buffers, 1, 32768 },
+    { "admin-port", &cfg.admin_port, 0, 65535 },
+    { "perf-counters", &cfg.perf_counters, 0, 1 },
+    { "trace-records", &cfg.trace_records, 1024, 1 << 26 },
+    { "ring-buffers", &cfg.ring_buffers, 0, 1 << 20 },
+    { "huge-pages", &cfg.huge_pages, 0, 1 },
+    { "async-threads", &cfg.async_threads, 0, 256 },
+    { NULL, NULL, 0, 0 }
+};
+
+/*
+ * Socket option profiles (--sockopt-profile), applied as a set of the settings above.
+ * Individual settings given after the profile still override it.
+ */
+struct sockopt_profile {
+    const char *name;
+    int rcvbuf;
+    int sndbuf;
+    int nodelay;
+    int quickack;
+    int defer_accept;
+    int fastopen;
+};
+
+static const struct sockopt_profile sockopt_profiles[] = {
+    { "kernel",     0,       0,       0, 0, 0, 0 },   // Kernel defaults, as accepted sockets used to be
+    { "latency",    0,       0,       1, 1, 0, 0 },   // Small request/response: no Nagle, no delayed ACKs
+    { "throughput", 4 << 20, 4 << 20, 1, 0, 0, 0 },   // Large payloads: big socket buffers
+    { "churn",      0,       0,       1, 0, 1, 256 }, // Connect storms: defer accept until data, TCP Fast Open
+    { NULL, 0, 0, 0, 0, 0, 0 }
+};
+
+// Config keys are returned as 0 by getopt_long(), the rest map to the short options
+static const struct option long_opts[] = {
+    { "client",    no_argument,       NULL, 'c' },
+    { "server",    no_argument,       NULL, 's' },
+    { "quiet",     no_argument,       NULL, 'q' },
+    { "address",   required_argument, NULL, 'a' },
+    { "port",      required_argument, NULL, 'p' },
+    { "config",    required_argument, NULL, 'f' },
+    { "backlog",   required_argument, NULL, 0 },
+    { "events",    required_argument, NULL, 0 },
+    { "read-size", required_argument, NULL, 0 },
+    { "max-msg",   required_argument, NULL, 0 },
+    { "workers",   required_argument, NULL, 0 },
+    { "rcvbuf",    required_argument, NULL, 0 },
+    { "sndbuf",    required_argument, NULL, 0 },
+    { "nodelay",   required_argument, NULL, 0 },
+    { "quickack",  required_argument, NULL, 0 },
+    { "defer-accept", required_argument, NULL, 0 },
+    { "fastopen",  required_argument, NULL, 0 },
+    { "rcvlowat",  required_argument, NULL, 0 },
+    { "sockopt-profile", required_argument, NULL, 0 },
+    { "cpus",      required_argument, NULL, 0 },
+    { "incoming-cpu", required_argument, NULL, 0 },
+    { "reuseport-cbpf", required_argument, NULL, 0 },
+    { "accept-mode", required_argument, NULL, 0 },
+    { "inbox",     required_argument, NULL, 0 },
+    { "rebalance-ms", required_argument, NULL, 0 },
+    { "rebalance-skew", required_argument, NULL, 0 },
+    { "reactor",   required_argument, NULL, 0 },
+    { "uring-sqpoll", required_argument, NULL, 0 },
+    { "uring-sqpoll-cpu", required_argument, NULL, 0 },
+    { "uring-buffers", required_argument, NULL, 0 },
+    { "admin-port", required_argument, NULL, 0 },
+    { "perf-counters", required_argument, NULL, 0 },
+    { "trace",     required_argument, NULL, 0 },
+    { "trace-records", required_argument, NULL, 0 },
+    { "ring-buffers", required_argument, NULL, 0 },
+    { "huge-pages", required_argument, NULL, 0 },
+    { "async-threads", required_argument, NULL, 0 },
+    { NULL, 0, NULL, 0 }
+};
+
+static int config_set(const char *key, const char *val);
+static int parse_cpu_list(const char *str);
+static int config_load(const char *path);
+static void config_check(void);
+
 void server_run();
 void client_run();
+void bench_run();
 
 // Determine run as server or client
 int main(int argc, char *argv[]) {
     int opt;
+    int longindex = 0;
     char role = 's'; // Run as a server default
 
     // To get the argument (not a standard UNIX function)
-    while ((opt = getopt(argc, argv, "csa:p:")) != -1) {
+    // Options are applied in order, so settings given after --config override the file
+    while ((opt = getopt_long(argc, argv, "csqa:p:f:w:m:T:r:D:d:n:l:o:F:B", long_opts, &longindex)) != -1) {
         switch (opt) {
+            case 0: // A server setting given as a long option
+                if (config_set(long_opts[longindex].name, optarg) < 0) {
+                    return EXIT_FAILURE;
+                }
+
+                break;
+            case 'f':
+                if (config_load(optarg) < 0) { // Read the server settings from a file
+                    return EXIT_FAILURE;
+                }
+
+                break;
             case 'c':
                 role = 'c'; // Run as a client
                 break;
@@ -58,15 +330,123 @@ int main(int argc, char *argv[]) {
                     return EXIT_FAILURE;
                 }
 
+                break;
+            case 'w':
+                window = atoi(optarg); // Convert the pipeline window from text to numeric (first value of a sweep list)
+                bench.window_list = optarg;
+                if (window <= 0) { // Check if the window is valid
+                    fprintf(stderr, "Cannot convert the pipeline window\n");
+                    return EXIT_FAILURE;
+                }
+
+                break;
+            case 'q':
+                verbose = 0; // Do not log every connection and request
+                break;
+            case 'm':
+                if (strcmp(optarg, "open") != 0 && strcmp(optarg, "pipe") != 0 &&
+                    strcmp(optarg, "churn") != 0 && strcmp(optarg, "sweep") != 0) { // Check if the benchmark mode is known
+                    fprintf(stderr, "Unknown benchmark mode: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+
+                bench.mode = optarg;
+                role = 'c'; // Benchmarks always run as a client
+                break;
+            case 'T':
+                if ((bench.threads = atoi(optarg)) <= 0) { // Check if the thread count is valid
+                    fprintf(stderr, "Cannot convert the number of threads\n");
+                    return EXIT_FAILURE;
+                }
+
+                break;
+            case 'r':
+                if ((bench.rate = atof(optarg)) <= 0) { // Check if the request rate is valid
+                    fprintf(stderr, "Cannot convert the request rate\n");
+                    return EXIT_FAILURE;
+                }
+
+                break;
+            case 'D':
+                if (strcmp(optarg, "poisson") == 0) {
+                    bench.poisson = 1;
+                } else if (strcmp(optarg, "const") == 0) {
+                    bench.poisson = 0;
+                } else {
+                    fprintf(stderr, "Unknown arrival distribution: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+
+                break;
+            case 'd':
+                if ((bench.duration = atoi(optarg)) <= 0) { // Check if the duration is valid
+                    fprintf(stderr, "Cannot convert the duration\n");
+                    return EXIT_FAILURE;
+                }
+
+                break;
+            case 'n':
+                bench.conns_list = optarg;
+                if ((bench.conns = atoi(optarg)) <= 0) { // Check if the connection count is valid
+                    fprintf(stderr, "Cannot convert the number of connections\n");
+                    return EXIT_FAILURE;
+                }
+
+                break;
+            case 'l':
+                bench.payload = atoi(optarg);
+                bench.payload_list = optarg;
+                if (bench.payload <= 0 || bench.payload >= MAX_MSG) { // Check if the payload size is valid
+                    fprintf(stderr, "Payload size must be between 1 and %d\n", MAX_MSG - 1);
+                    return EXIT_FAILURE;
+                }
+
+                break;
+            case 'o':
+                bench.hist_file = optarg; // Histogram (or sweep results) output file
+                break;
+            case 'B':
+                bench.binary = 1; // Length-prefixed binary requests instead of null-terminated text
+                break;
+            case 'F':
+                if (strcmp(optarg, "json") == 0) {
+                    bench.json = 1;
+                } else if (strcmp(optarg, "csv") == 0) {
+                    bench.json = 0;
+                } else {
+                    fprintf(stderr, "Unknown output format: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+
                 break;
             default: // Print usage when being given the error arguments
-                printf("usage: %s [-cs] [-a address] [-p port]\n", argv[0]);
+                printf("usage: %s [-cs] [-q] [-a address] [-p port] [-w window]\n"
+                       "       %s -s [--config file] [--backlog n] [--events n] [--read-size bytes] [--max-msg bytes]\n"
+                       "             [--workers n] [--sockopt-profile kernel|latency|throughput|churn] [--rcvbuf bytes] [--sndbuf bytes]\n"
+                       "             [--nodelay 0|1] [--quickack 0|1] [--defer-accept secs] [--fastopen qlen] [--rcvlowat bytes]\n"
+                       "             [--cpus list|all] [--incoming-cpu 0|1] [--reuseport-cbpf 0|1]\n"
+                       "             [--accept-mode reuseport|handoff|exclusive] [--inbox n] [--rebalance-ms ms] [--rebalance-skew percent]\n"
+                       "             [--reactor epoll-et|epoll-lt|poll|io_uring|io_uring-fixed]\n"
+                       "             [--uring-sqpoll idle-ms] [--uring-sqpoll-cpu cpu] [--uring-buffers n] [--admin-port port]\n"
+                       "             [--perf-counters 0|1] [--trace path] [--trace-records n]\n"
+                       "             [--ring-buffers n] [--huge-pages 0|1] [--async-threads n]\n"
+                       "       %s -m open [-B] [-T threads] [-r rate] [-D const|poisson] [-d seconds] [-n conns] [-l bytes] [-o histfile]\n"
+                       "       %s -m pipe [-B] [-T threads] [-w window] [-d seconds] [-n conns] [-l bytes] [-o histfile]\n"
+                       "       %s -m churn [-T threads] [-d seconds] [-o histfile]\n"
+                       "       %s -m sweep [-B] [-T threads] [-l bytes,...] [-n conns,...] [-w depth,...] [-d seconds] [-F csv|json] [-o file]\n",
+                       argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
                 return EXIT_FAILURE;
         }
     }
 
+    // Writing to a socket closed by the peer must return EPIPE instead of killing the process
+    signal(SIGPIPE, SIG_IGN);
+
     if (role == 's') {
+        config_check();
         server_run();
+    } else if (bench.mode != NULL) {
+        bench_run();
     } else {
         client_run();
     }
@@ -74,6 +454,221 @@ int main(int argc, char *argv[]) {
     return EXIT_SUCCESS;
 }
 
+// Set a server setting by name, with range validation
+static int config_set(const char *key, const char *val) {
+    long v;
+    char *end;
+    const struct config_key *k;
+    const struct sockopt_profile *sp;
+
+    if (strcmp(key, "cpus") == 0) {
+        return parse_cpu_list(val);
+    }
+
+    if (strcmp(key, "trace") == 0) {
+        free(trace_path);
+        if ((trace_path = strdup(val)) == NULL) {
+            perror("[!] strdup()");
+            exit(EXIT_FAILURE);
+        }
+        return 0;
+    }
+
+    if (strcmp(key, "accept-mode") == 0) {
+        for (v = 0; accept_modes[v] != NULL; v++) {
+            if (strcmp(accept_modes[v], val) == 0) {
+                cfg.accept_mode = (int)v;
+                return 0;
+            }
+        }
+
+        fprintf(stderr, "Unknown accept mode: %s (reuseport, handoff, exclusive)\n", val);
+        return -1;
+    }
+
+    if (strcmp(key, "reactor") == 0) {
+        for (v = 0; reactor_names[v] != NULL; v++) {
+            if (strcmp(reactor_names[v], val) == 0) {
+                cfg.reactor = (int)v;
+                return 0;
+            }
+        }
+
+        fprintf(stderr, "Unknown reactor: %s (epoll-et, epoll-lt, poll, io_uring, io_uring-fixed)\n", val);
+        return -1;
+    }
+
+    if (strcmp(key, "sockopt-profile") == 0) {
+        for (sp = sockopt_profiles; sp->name != NULL; sp++) {
+            if (strcmp(sp->name, val) == 0) {
+                cfg.rcvbuf = sp->rcvbuf;
+                cfg.sndbuf = sp->sndbuf;
+                cfg.nodelay = sp->nodelay;
+                cfg.quickack = sp->quickack;
+                cfg.defer_accept = sp->defer_accept;
+                cfg.fastopen = sp->fastopen;
+                return 0;
+            }
+        }
+
+        fprintf(stderr, "Unknown socket option profile: %s (kernel, latency, throughput, churn)\n", val);
+        return -1;
+    }
+
+    for (k = config_keys; k->name != NULL; k++) {
+        if (strcmp(k->name, key) != 0) {
+            continue;
+        }
+
+        errno = 0;
+        v = strtol(val, &end, 0);
+        if (errno != 0 || end == val || *end != '\0' || v < k->min || v > k->max) {
+            fprintf(stderr, "Invalid %s: %s (expected %d..%d)\n", key, val, k->min, k->max);
+            return -1;
+        }
+
+        *k->val = (int)v;
+        return 0;
+    }
+
+    fprintf(stderr, "Unknown setting: %s\n", key);
+    return -1;
+}
+
+// Parse "0-3,8,10-11" (or "all": every CPU the process may run on) into cpu_list
+static int parse_cpu_list(const char *str) {
+    int i;
+    long lo;
+    long hi;
+    char *end;
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    if (strcmp(str, "all") == 0) {
+        sched_getaffinity(0, sizeof(set), &set);
+    } else {
+        while (*str != '\0') {
+            lo = strtol(str, &end, 10);
+            hi = lo;
+            if (end != str && *end == '-') {
+                str = end + 1;
+                hi = strtol(str, &end, 10);
+            }
+            if (end == str || lo < 0 || hi < lo || hi >= CPU_SETSIZE || (*end != ',' && *end != '\0')) {
+                fprintf(stderr, "Invalid CPU list: %s\n", str);
+                return -1;
+            }
+
+            for (i = lo; i <= hi; i++) {
+                CPU_SET(i, &set);
+            }
+            str = *end == ',' ? end + 1 : end;
+        }
+    }
+
+    free(cpu_list);
+    cpu_count = 0;
+    if ((cpu_list = malloc(CPU_COUNT(&set) * sizeof(*cpu_list))) == NULL) {
+        perror("malloc()");
+        return -1;
+    }
+    for (i = 0; i < CPU_SETSIZE; i++) {
+        if (CPU_ISSET(i, &set)) {
+            cpu_list[cpu_count++] = i;
+        }
+    }
+
+    return 0;
+}
+
+// Load "key = value" lines, '#' starts a comment
+static int config_load(const char *path) {
+    int lineno = 0;
+    char line[MAX_LINE];
+    char *key;
+    char *val;
+    char *p;
+    FILE *fp;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        perror("Cannot open the config file");
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        lineno++;
+        if ((p = strchr(line, '#')) != NULL) {
+            *p = '\0';
+        }
+
+        // Split at '=' (or the first blank) and trim both sides
+        key = line + strspn(line, " \t\r\n");
+        if (*key == '\0') {
+            continue;
+        }
+        val = key + strcspn(key, " \t=");
+        p = val;
+        val += strspn(val, " \t");
+        if (*val == '=') {
+            val++;
+        }
+        *p = '\0';
+        val += strspn(val, " \t");
+        val[strcspn(val, " \t\r\n")] = '\0';
+
+        if (config_set(key, val) < 0) {
+            fprintf(stderr, "%s:%d: invalid line\n", path, lineno);
+            fclose(fp);
+            return -1;
+        }
+    }
+
+    fclose(fp);
+    return 0;
+}
+
+// Cross-check the settings against the host before starting
+static void config_check(void) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int somaxconn = -1;
+    FILE *fp;
+
+    if ((fp = fopen("/proc/sys/net/core/somaxconn", "r")) != NULL) {
+        if (fscanf(fp, "%d", &somaxconn) != 1) {
+            somaxconn = -1;
+        }
+        fclose(fp);
+    }
+
+    if (somaxconn > 0 && cfg.backlog > somaxconn) {
+        fprintf(stderr, "[!] backlog %d is capped by net.core.somaxconn (%d)\n", cfg.backlog, somaxconn);
+    }
+    if (ncpu > 0 && cfg.workers > ncpu) {
+        fprintf(stderr, "[!] %d workers on %ld online CPUs\n", cfg.workers, ncpu);
+    }
+    if (cfg.max_msg < cfg.read_size) {
+        fprintf(stderr, "[!] max-msg (%d) is smaller than read-size (%d)\n", cfg.max_msg, cfg.read_size);
+        exit(EXIT_FAILURE);
+    }
+    // Receive completions can still be on their way when a connection is handed to another worker
+    if (strcmp(reactor_names[cfg.reactor], "io_uring-fixed") == 0 && cfg.rebalance_ms > 0) {
+        fprintf(stderr, "[!] %s does not support rebalancing, rebalance-ms ignored\n", reactor_names[cfg.reactor]);
+        cfg.rebalance_ms = 0;
+    }
+    if (cfg.uring_sqpoll > 0 && strncmp(reactor_names[cfg.reactor], "io_uring", 8) != 0) {
+        fprintf(stderr, "[!] uring-sqpoll only applies to the io_uring reactors\n");
+    }
+#ifndef EPOLL_TRACE
+    if (trace_path != NULL) {
+        fprintf(stderr, "[!] built without EPOLL_TRACE (make trace), trace ignored\n");
+    }
+#endif
+    if (cfg.admin_port == port) {
+        fprintf(stderr, "[!] admin-port must differ from the server port (%d)\n", port);
+        exit(EXIT_FAILURE);
+    }
+}
+
 static void epoll_ctl_add(int epfd, int fd, uint32_t events) {
     // Create an epoll event struct
     // events: a bit mask specifying the events the application is interested in for the file descriptor
@@ -108,205 +703,4851 @@ static int setnonblocking(int sockfd) {
     if (fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK) == -1) {
         return -1;
     }
-    
+
     return 0;
 }
 
-void server_run() {
-    int i;
-    int n;
-    int epfd;
-    int nfds;
-    int listen_sock;
-    int conn_sock;
-    int socklen;
-    char buf[BUF_SIZE];
-    struct sockaddr_in srv_addr;
-    struct sockaddr_in cli_addr;
-    struct epoll_event events[MAX_EVENTS];
+static uint64_t now_ns(void) {
+    struct timespec ts;
 
-    time_t t;
-    struct tm *tm;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-    // Create a socket using TCP protocol in IPv4 domain & get the file descriptor
-    if((listen_sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("[!] Cannot create socket file descriptor\n");
-        exit(EXIT_FAILURE);
+/*
+ * Growable byte buffer used for partial messages and pending output.
+ * Data lives in data[off, len); consumed bytes are reclaimed lazily.
+ */
+struct buffer {
+    char *data;
+    size_t off;
+    size_t len;
+    size_t cap;
+    int kind;       // Storage, see struct buffer_pool
+};
+
+#define BUFFER_HEAP 0   // malloc()ed
+#define BUFFER_RING 1   // A ring mapped twice: [data + cap, data + 2 * cap) repeats [data, data + cap)
+#define BUFFER_HUGE 2   // A chunk of a huge page arena
+
+static size_t buffer_size(const struct buffer *b) {
+    return b->len - b->off;
+}
+
+static void buffer_append(struct buffer *b, const char *p, size_t n) {
+    // A ring never moves or grows: off < cap, so data[off, off + cap) is always mapped
+    if (b->kind == BUFFER_RING) {
+        if (buffer_size(b) + n > b->cap) {
+            fprintf(stderr, "[!] ring buffer overflow\n");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(b->data + b->len, p, n);
+        b->len += n;
+        return;
     }
 
-    // Set the socket address & port information for the server
-    set_sockaddr(&srv_addr);
-    
-    // Give the socket fd the local address with the size of the info struct
-    if(bind(listen_sock, (struct sockaddr *)&srv_addr, sizeof(srv_addr)) < 0) {
-        perror("[!] Cannot bind the socket\n");
-        exit(EXIT_FAILURE);
+    // Move the unconsumed bytes to the front before growing the storage
+    if (b->off > 0 && b->len + n > b->cap) {
+        memmove(b->data, b->data + b->off, b->len - b->off);
+        b->len -= b->off;
+        b->off = 0;
     }
 
-    // Set the file descriptor to non-blocking mode because of using epoll edge-triggered mode
-    if(setnonblocking(listen_sock) < 0) {
-        perror("[!] Cannot set the socket to non-blocking mode\n");
-        exit(EXIT_FAILURE);
+    if (b->len + n > b->cap) {
+        size_t cap = b->cap ? b->cap : MAX_LINE;
+        while (cap < b->len + n) {
+            cap *= 2;
+        }
+
+        if ((b->data = realloc(b->data, cap)) == NULL) {
+            perror("[!] realloc()");
+            exit(EXIT_FAILURE);
+        }
+        b->cap = cap;
     }
 
-    // Set the socket to listen mode with at most 16 connections
-    if(listen(listen_sock, MAX_CONN) < 0) {
-        perror("[!] Cannot listen on the socket\n");
-        exit(EXIT_FAILURE);
+    memcpy(b->data + b->len, p, n);
+    b->len += n;
+}
+
+static void buffer_consume(struct buffer *b, size_t n) {
+    b->off += n;
+    if (b->off == b->len) { // Everything consumed, rewind to the start
+        b->off = 0;
+        b->len = 0;
+    } else if (b->off >= b->cap) { // Only a ring gets here: continue in its first view
+        b->off -= b->cap;
+        b->len -= b->cap;
     }
+}
 
-    // Create an epoll file descriptor (size parameter is deprecated but still required to be larger than 0)
-    if((epfd = epoll_create(1)) == -1) {
-        perror("[!] Cannot create epoll file descriptor\n");
-        exit(EXIT_FAILURE);
+static void buffer_free(struct buffer *b) {
+    free(b->data);
+    bzero(b, sizeof(*b));
+}
+
+/*
+ * Anonymous memory for the connection slab and the buffer pools. With --huge-pages it
+ * is backed by huge pages, so a few TLB entries cover what would otherwise take
+ * thousands: reserved hugetlb pages if the system has enough of them (MAP_HUGETLB
+ * reserves them all up front, so running out later cannot fault), otherwise
+ * transparent huge pages (madvise), which the kernel assembles as the memory is
+ * touched. `noreserve` maps ordinary pages with MAP_NORESERVE, for large ranges of
+ * which only a part is ever used.
+ */
+static void *huge_map(size_t len, int noreserve, const char *what) {
+    char *p;
+    size_t pad;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | (noreserve ? MAP_NORESERVE : 0);
+
+    if (!cfg.huge_pages) {
+        return mmap(NULL, len, PROT_READ | PROT_WRITE, flags, -1, 0);
     }
 
-    // Add the listen socket to the events queue in epoll file descriptor
-    // EPOLLIN: The associated file is available for read(2) operations
-    // EPOLLOUT: The associated file is available for write(2) operations
-    // EPOLLET: Sets the Edge Triggered behavior for the associated file descriptor
-    epoll_ctl_add(epfd, listen_sock, EPOLLIN | EPOLLOUT | EPOLLET);\
+    len = (len + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+    p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) {
+        if (verbose) {
+            printf("[+] %s: %zu MiB in hugetlb pages\n", what, len >> 20);
+        }
+        return p;
+    }
 
-    // Add stdin to the events queue in epoll file descriptor
-    epoll_ctl_add(epfd, STDIN_FILENO, EPOLLIN | EPOLLET);
+    // Only the 2 MiB aligned part of a range can be a transparent huge page, so align it
+    if ((p = mmap(NULL, len + HUGE_PAGE, PROT_READ | PROT_WRITE, flags, -1, 0)) == MAP_FAILED) {
+        return MAP_FAILED;
+    }
+    pad = HUGE_PAGE - ((uintptr_t)p & (HUGE_PAGE - 1));
+    munmap(p, pad);
+    munmap(p + pad + len, HUGE_PAGE - pad);
+    p += pad;
 
-    // The size of the client address info struct
-    socklen = sizeof(cli_addr);
+    if (madvise(p, len, MADV_HUGEPAGE) == -1) {
+        fprintf(stderr, "[!] %s: no hugetlb pages and madvise(MADV_HUGEPAGE): %s, using normal pages\n",
+                what, strerror(errno));
+    } else if (verbose) {
+        printf("[+] %s: %zu MiB in transparent huge pages (not enough hugetlb pages)\n", what, len >> 20);
+    }
+    return p;
+}
 
-    // Start to handle the events
-    for (;;) {
-        // Wait for events on an epoll instance
-        // nfds: the number of file descriptors ready for the requested I/O operations (triggered events)
-        // events: the buffer where the triggered events are stored
-        nfds = epoll_wait(epfd, events, MAX_EVENTS, -1);
-        for (i = 0; i < nfds; i++) {
-            if (events[i].data.fd == listen_sock) { // The listen socket is ready for read
-                /* handle new connection */
-                // Accept the incoming connection and get the file descriptor of the new client socket fd
-                conn_sock = accept(listen_sock, (struct sockaddr *)&cli_addr, &socklen);
-
-                // Convert the IP address from binary to text
-                inet_ntop(AF_INET, (char *)&(cli_addr.sin_addr), buf, sizeof(cli_addr));
-                printf("[+] connected with %s:%d\n", buf, ntohs(cli_addr.sin_port));
-
-                setnonblocking(conn_sock); // Set the client socket to non-blocking mode
-
-                // Add the client socket to the events queue
-                // EPOLLRDHUP: Stream socket peer closed connection, or shut down writing half of connection
-                // EPOLLHUP: Hang up happened on the associated file descriptor
-                epoll_ctl_add(epfd, conn_sock, EPOLLIN | EPOLLET | EPOLLRDHUP | EPOLLHUP);
-            } else if (events[i].data.fd == STDIN_FILENO) { // The stdin is ready for read
-                /* handle stdin */
-                for (;;) {
-                    bzero(buf, sizeof(buf)); // Set the buffer to 0s
-
-                    // Read the data from the stdin to the buffer
-                    // EAGAIN: Try read again because of resource is temporarily unavailable (non-blocking mode)
-                    if ((n = read(STDIN_FILENO, buf, sizeof(buf))) <= 0 /* || errno == EAGAIN */ ) {
-                        break;
-                    } else {
-                        if(strcmp(buf, "exit\n") == 0) { // Check if the input is "exit"
-                            close(listen_sock); // Close the listen socket
-                            close(epfd); // Close the epoll file descriptor
-                            exit(EXIT_SUCCESS);
-                        } else {
-                            printf("[+] stdin (%d bytes): %s\n", n, buf);
-                        }
-                    }
-                }
-            } else if (events[i].events & EPOLLIN) { // The client socket is ready for read
-                /* handle EPOLLIN event */
-                for (;;) {
-                    bzero(buf, sizeof(buf)); // Set the buffer to 0s
-                    
-                    // Read the data from the client socket to the buffer
-                    if ((n = read(events[i].data.fd, buf, sizeof(buf))) <= 0 /* || errno == EAGAIN */ ) {
-                        break;
-                    } else {
-                        printf("[+] data (%d bytes): %s", n, buf);
-
-                        /* Echo function */
-                        if(strcmp(buf, "%date%") == 0) { // Check if the input is "%%date%%"
-                            t = time(NULL);
-                            tm = localtime(&t);
-                            strftime(buf, sizeof(buf), "%x", tm);
-                        } else if(strcmp(buf, "%time%") == 0) { // Check if the input is "%%time%%"
-                            t = time(NULL);
-                            tm = localtime(&t);
-                            strftime(buf, sizeof(buf), "%X", tm);
-                        }
-
-                        // Write the data back to the client socket
-                        if(write(events[i].data.fd, buf, strlen(buf)) < 0) {
-                            perror("[!] write()");
-                        }
-
-                        printf(" -> %s\n", buf);
-                    }
-                }
-            } else {
-                printf("[+] unexpected\n");
-            }
-            
-            /* check if the connection is closing */
-            if (events[i].events & (EPOLLRDHUP | EPOLLHUP)) {
-                printf("[+] connection closed\n");
+/*
+ * Free BUFFER_CHUNK byte buffers of one worker, shared by all of its connections.
+ * A connection only holds buffers while it has a partial request or unsent
+ * responses, so idle connections cost no buffer memory. The list is LIFO, so the
+ * buffer a connection gets is usually still in the cache from the previous one.
+ *
+ * A pool hands out one kind of buffer. By default they are rings (BUFFER_RING): a
+ * BUFFER_CHUNK piece of a memfd mapped twice, back to back. Data that wraps around
+ * the end of a ring is still one contiguous range for read(), write() and the
+ * parser, so nothing is ever moved to make room and no I/O is split at the wrap
+ * point. A worker maps its rings into one reserved range of address space at
+ * consecutive file offsets; the second view of a ring and the first view of the next
+ * one continue each other, so the kernel merges them and a ring costs about one VMA.
+ *
+ * A double mapping of 4 KiB pieces cannot use huge pages, so with --huge-pages the
+ * pool carves plain chunks (BUFFER_HUGE) out of a huge page arena instead. Either way
+ * the arena holds --ring-buffers buffers, created when the pool runs dry and never
+ * unmapped, and further buffers come from malloc(). With --ring-buffers 0 every
+ * buffer is a malloc()ed chunk (BUFFER_HEAP).
+ */
+struct buffer_pool {
+    void *free;     // Linked through the first bytes of each buffer
+    int nfree;
+    int kind;       // BUFFER_RING, BUFFER_HUGE or BUFFER_HEAP
+    int memfd;      // Backing file of the rings, -1 for other kinds
+    char *arena;    // Address space reserved for the buffers, two views per ring
+    size_t reserved;
+    int mapped;     // Buffers created in the arena so far
+    int max_mapped;
+};
 
-                // Remove the file descriptor from the events queue
-                epoll_ctl(epfd, EPOLL_CTL_DEL, events[i].data.fd, NULL);
+// Without memfd_create() or the address space, the pool hands out malloc()ed chunks
+static void buffer_pool_init(struct buffer_pool *pool, int max_mapped) {
+    pool->free = NULL;
+    pool->nfree = 0;
+    pool->kind = max_mapped == 0 ? BUFFER_HEAP : cfg.huge_pages ? BUFFER_HUGE : BUFFER_RING;
+    pool->memfd = -1;
+    pool->arena = NULL;
+    pool->reserved = (size_t)max_mapped * (pool->kind == BUFFER_RING ? 2 : 1) * BUFFER_CHUNK;
+    pool->mapped = 0;
+    pool->max_mapped = max_mapped;
 
-                // Close the file descriptor of the client socket
-                close(events[i].data.fd);
-            }
+    if (pool->kind == BUFFER_HUGE) {
+        pool->arena = huge_map(pool->reserved, 1, "buffer pool");
+    } else if (pool->kind == BUFFER_RING) {
+        if ((pool->memfd = memfd_create("epoll-rings", MFD_CLOEXEC)) == -1) {
+            perror("[!] memfd_create(), ring buffers off");
+            pool->kind = BUFFER_HEAP;
+            return;
+        }
+        pool->arena = mmap(NULL, pool->reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    }
+    if (pool->arena == MAP_FAILED) {
+        perror("[!] mmap() of the buffer pool, using malloc()");
+        if (pool->memfd >= 0) {
+            close(pool->memfd);
+            pool->memfd = -1;
         }
+        pool->arena = NULL;
+        pool->kind = BUFFER_HEAP;
     }
 }
 
-void client_run() {
-    int n;
-    int c;
-    int sockfd;
-    char buf[MAX_LINE];
-    struct sockaddr_in srv_addr;
+// Create one more buffer in the arena, NULL once the pool has all of them
+static char *buffer_pool_map(struct buffer_pool *pool) {
+    off_t off = (off_t)pool->mapped * BUFFER_CHUNK;
+    char *p = pool->arena + (pool->kind == BUFFER_RING ? 2 : 1) * (size_t)off;
 
-    // Create a socket using TCP protocol in IPv4 domain & get the file descriptor
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (pool->kind == BUFFER_HEAP || pool->mapped == pool->max_mapped) {
+        return NULL;
+    }
+    if (pool->kind == BUFFER_RING) {
+        if (ftruncate(pool->memfd, off + BUFFER_CHUNK) == -1) {
+            return NULL;
+        }
+        if (mmap(p, BUFFER_CHUNK, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, pool->memfd, off) == MAP_FAILED ||
+            mmap(p + BUFFER_CHUNK, BUFFER_CHUNK, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, pool->memfd,
+                 off) == MAP_FAILED) {
+            perror("[!] mmap() of a ring"); // Out of VMAs (vm.max_map_count), stop creating rings
+            pool->max_mapped = pool->mapped;
+            return NULL;
+        }
+    }
+    pool->mapped++;
 
-    // Set the socket address & port information for the server
-    set_sockaddr(&srv_addr);
+    return p;
+}
 
-    // Connect to the server
-    if (connect(sockfd, (struct sockaddr *)&srv_addr, sizeof(srv_addr)) < 0) {
-        perror("cannot connect to the server\n");
-        exit(1);
+// Give an empty, detached buffer a pooled one to append to
+static void buffer_attach(struct buffer_pool *pool, struct buffer *b) {
+    void *p = pool->free;
+
+    b->kind = pool->kind;
+    if (p != NULL) {
+        pool->free = *(void **)p;
+        pool->nfree--;
+    } else if ((p = buffer_pool_map(pool)) != NULL) {
+        // A new buffer of the arena
+    } else if ((p = malloc(BUFFER_CHUNK)) == NULL) {
+        perror("[!] malloc()");
+        exit(EXIT_FAILURE);
+    } else {
+        b->kind = BUFFER_HEAP;
     }
 
-    // Start the communication with the server
-    for (;;) {
-        printf("input: ");
-        fgets(buf, sizeof(buf), stdin); // Get the input from the user
-        c = strlen(buf) - 1;
-        buf[c] = '\0'; // Replace the newline character with the null character
+    b->data = p;
+    b->off = 0;
+    b->len = 0;
+    b->cap = BUFFER_CHUNK;
+}
 
-        if (strcmp(buf, "exit") == 0) { // Check if the input is "exit"
-            break;
-        }
+// Detach the storage of a buffer. A pool only takes buffers of its own kind, since it hands out
+// every free buffer as one; heap chunks only up to BUFFER_POOL_MAX. Other heap buffers go back to
+// malloc(), other arena buffers stay where they are, in the arena of the worker that created them
+static void buffer_release(struct buffer_pool *pool, struct buffer *b) {
+    if (b->kind == pool->kind &&
+        (b->kind != BUFFER_HEAP || (b->cap == BUFFER_CHUNK && pool->nfree < BUFFER_POOL_MAX))) {
+        *(void **)b->data = pool->free;
+        pool->free = b->data;
+        pool->nfree++;
+    } else if (b->kind == BUFFER_HEAP) {
+        free(b->data);
+    }
+    bzero(b, sizeof(*b));
+}
+
+// Free the pooled heap chunks. An arena pool's list is not walked: after a migration it may
+// hold buffers of another worker's arena, which can be gone already (see buffer_pool_unmap)
+static void buffer_pool_free(struct buffer_pool *pool) {
+    void *p;
+
+    while (pool->kind == BUFFER_HEAP && (p = pool->free) != NULL) {
+        pool->free = *(void **)p;
+        free(p);
+    }
+    pool->free = NULL;
+    pool->nfree = 0;
+}
 
-        write(sockfd, buf, c + 1); // Send the input to the server
+// Unmap the arena, only once every pool is freed
+static void buffer_pool_unmap(struct buffer_pool *pool) {
+    if (pool->arena != NULL) {
+        munmap(pool->arena, pool->kind == BUFFER_HUGE ? (pool->reserved + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1)
+                                                      : pool->reserved);
+    }
+    if (pool->memfd >= 0) {
+        close(pool->memfd);
+    }
+}
+
+// Find the end of the first message ('\0' or '\n' terminated) in the buffer, NULL if incomplete
+// The first `skip` unconsumed bytes are known to hold no terminator and are not scanned again
+static char *buffer_find_msg(const struct buffer *b, size_t skip) {
+    char *p;
+    char *end = b->data + b->len;
 
-        bzero(buf, sizeof(buf)); // Reset the buffer
+    for (p = b->data + b->off + skip; p < end; p++) {
+        if (*p == '\0' || *p == '\n') {
+            return p;
+        }
+    }
 
-        // Receive the data from the server
-        while (errno != EAGAIN && (n = read(sockfd, buf, sizeof(buf))) > 0) {
-            printf("echo: %s\n", buf);
-            bzero(buf, sizeof(buf));
+    return NULL;
+}
 
-            if ((c -= n) <= 0) { // Check if the data is fully received
-                break;
+// Write as much pending output as the socket accepts, return -1 if the connection is broken
+static int buffer_flush(struct buffer *b, int fd) {
+    ssize_t n;
+
+    while (buffer_size(b) > 0) {
+        if ((n = write(fd, b->data + b->off, buffer_size(b))) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0; // The kernel buffer is full, wait for EPOLLOUT
+            } else if (errno == EINTR) {
+                continue;
             }
+
+            return -1;
         }
+
+        buffer_consume(b, n);
     }
 
-    // Close the file descriptor
-    close(sockfd);
+    return 0;
+}
+
+/*
+ * Server side connection state.
+ * Requests are terminated by '\0' (epoll client) or '\n' (telnet, nc), and every
+ * response is terminated by the same byte so the peer can match it to its request.
+ */
+struct conn {
+    int fd;
+    struct buffer in;  // Partial request waiting for its terminator
+    struct buffer out; // Responses not yet accepted by the socket
+    struct conn *prev; // Connections of the owning worker
+    struct conn *next;
+    unsigned activity; // Requests since the owning worker last moved connections away
+    int want_out;      // EPOLLOUT is registered (level-triggered reactors)
+    size_t scanned;    // Bytes of `in` known to hold no terminator
+    int admin;         // ADMIN_* state of a connection to the admin endpoint, 0 for clients
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t msgs;
+    uint64_t msgs_ranked; // msgs when the connection was last ranked
+    uint64_t last_active; // now_ns() of the last event, tracked with the admin endpoint
+    uint32_t win_msgs;  // Requests in the worker's current ranking window
+    uint32_t win_epoch; // The window win_msgs belongs to
+    int top_rank;       // Position + 1 in the worker's list of busiest connections, 0 if not there
+    uint32_t peer_addr; // Filled in when the connection first makes it into a published list
+    uint16_t peer_port;
+    uint8_t proto;      // PROTO_TEXT or PROTO_BINARY, PROTO_NONE until the first byte arrives
+    uint8_t async;      // Requests of the connection in the async pool, which keep it on its worker
+} __attribute__((aligned(64))); // Slab slots start on a cache line, so neighbouring connections share none
+
+#define PROTO_NONE   0
+#define PROTO_TEXT   1
+#define PROTO_BINARY 2
+
+/*
+ * Bounded lock-free multi-producer, single-consumer queue of file descriptors.
+ * A producer claims a slot by advancing `tail` with a CAS and publishes it by
+ * setting the slot's sequence number to pos + 1; the owning worker is the only
+ * consumer, so `head` is a plain counter. A slot becomes free again once its
+ * sequence number reaches pos + capacity.
+ */
+struct fd_slot {
+    _Atomic size_t seq;
+    int fd;
+};
+
+struct fd_queue {
+    struct fd_slot *slots;
+    size_t mask;                          // Capacity - 1, the capacity is a power of two
+    _Atomic size_t tail;                  // Next position to claim (producers)
+    char pad[64 - sizeof(size_t)];        // Keep the consumer off the producers' cache line
+    size_t head;                          // Next position to take (consumer)
+};
+
+static void fd_queue_init(struct fd_queue *q, int size) {
+    size_t i;
+    size_t cap = 1;
+
+    while (cap < (size_t)size) {
+        cap *= 2;
+    }
+
+    if ((q->slots = calloc(cap, sizeof(*q->slots))) == NULL) {
+        perror("[!] calloc()");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < cap; i++) {
+        atomic_init(&q->slots[i].seq, i);
+    }
+    q->mask = cap - 1;
+    atomic_init(&q->tail, 0);
+    q->head = 0;
+}
+
+// Safe from any thread, return -1 if the queue is full
+static int fd_queue_push(struct fd_queue *q, int fd) {
+    size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    struct fd_slot *slot;
+    intptr_t dif;
+
+    for (;;) {
+        slot = &q->slots[pos & q->mask];
+        dif = (intptr_t)(atomic_load_explicit(&slot->seq, memory_order_acquire) - pos);
+        if (dif == 0) { // The slot is free, try to claim it (a failed CAS reloads pos)
+            if (atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (dif < 0) { // The consumer has not taken this slot yet
+            return -1;
+        } else { // Another producer claimed it first
+            pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+        }
+    }
+
+    slot->fd = fd;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    return 0;
+}
+
+// Only called by the owning worker, return -1 if the queue is empty
+static int fd_queue_pop(struct fd_queue *q) {
+    int fd;
+    struct fd_slot *slot = &q->slots[q->head & q->mask];
+
+    if (atomic_load_explicit(&slot->seq, memory_order_acquire) != q->head + 1) {
+        return -1;
+    }
+
+    fd = slot->fd;
+    atomic_store_explicit(&slot->seq, q->head + q->mask + 1, memory_order_release);
+    q->head++;
+    return fd;
+}
+
+/*
+ * Trace points, see trace.h. Without -DEPOLL_TRACE they compile to nothing. With it
+ * they cost a branch while --trace is not given, and otherwise a time stamp counter
+ * read and a 24 byte store into the worker's own mapping.
+ */
+struct trace_ring {
+    struct trace_header *hdr;
+    struct trace_record *recs;
+    uint64_t mask;
+    size_t size;        // Of the mapping
+};
+
+#ifdef EPOLL_TRACE
+static uint64_t trace_hz = 1000000000;
+
+static uint64_t trace_tsc(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    return now_ns();
+#endif
+}
+
+// Ticks of trace_tsc() per second, measured against CLOCK_MONOTONIC
+static void trace_calibrate(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    struct timespec ts = { 0, 20000000 };
+    uint64_t t0 = now_ns();
+    uint64_t c0 = trace_tsc();
+
+    nanosleep(&ts, NULL);
+    trace_hz = (uint64_t)((trace_tsc() - c0) * 1e9 / (now_ns() - t0));
+#endif
+}
+
+static void trace_emit(struct trace_ring *t, uint32_t type, int fd, uint64_t arg) {
+    uint64_t head = t->hdr->head;
+    struct trace_record *r = &t->recs[head & t->mask];
+
+    r->tsc = trace_tsc();
+    r->type = type;
+    r->fd = fd;
+    r->arg = arg;
+    __atomic_store_n(&t->hdr->head, head + 1, __ATOMIC_RELEASE); // A reader sees the record before the count
+}
+
+#define TRACE(w, type, fd, arg) do { \
+        if ((w)->trace != NULL) { \
+            trace_emit((w)->trace, (type), (fd), (arg)); \
+        } \
+    } while (0)
+#else
+#define TRACE(w, type, fd, arg) do { } while (0)
+#endif
+
+// Request types, counted per worker (see cmd_names)
+#define CMD_ECHO  0
+#define CMD_DATE  1
+#define CMD_TIME  2
+#define CMD_ADMIN 3
+#define CMD_SLEEP 4
+#define CMD_COUNT 5
+
+static const char *const cmd_names[] = { "echo", "date", "time", "admin", "sleep" };
+
+// Upper bounds of the response latency buckets in nanoseconds, the last bucket is +Inf
+static const uint64_t latency_bounds[] = {
+    1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000, 10000000, 25000000, 50000000, 100000000
+};
+#define LATENCY_BUCKETS (sizeof(latency_bounds) / sizeof(latency_bounds[0]) + 1)
+
+/*
+ * Counters of one worker, read by the admin endpoint (see metrics_write). Only the
+ * owning worker writes them, so an update is a relaxed load and store instead of a
+ * locked read-modify-write, and a scrape from another thread still sees whole values.
+ */
+struct worker_stats {
+    _Atomic uint64_t accepted;      // Connections created by this worker
+    _Atomic uint64_t closed;        // Connections closed by this worker (possibly accepted by another)
+    _Atomic uint64_t bytes_in;
+    _Atomic uint64_t bytes_out;
+    _Atomic uint64_t wakeups;       // Returns from the reactor's wait
+    _Atomic uint64_t events;
+    _Atomic uint64_t commands[CMD_COUNT];
+    _Atomic uint64_t latency[LATENCY_BUCKETS]; // Wakeup to responses handed to the socket, per event
+    _Atomic uint64_t latency_sum;   // Nanoseconds
+    _Atomic uint64_t buffers_attached; // Pooled buffers handed to connections
+    _Atomic uint64_t buffers_released; // Buffers connections gave back (possibly attached by another worker)
+    _Atomic uint64_t async_started; // Requests handed to the async pool
+    _Atomic uint64_t async_finished; // Requests the pool gave back, answered unless the connection closed meanwhile
+};
+
+static void stat_add(_Atomic uint64_t *p, uint64_t n) {
+    atomic_store_explicit(p, atomic_load_explicit(p, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static void stat_latency(struct worker_stats *st, uint64_t ns) {
+    size_t i = 0;
+
+    while (i < LATENCY_BUCKETS - 1 && ns > latency_bounds[i]) {
+        i++;
+    }
+    stat_add(&st->latency[i], 1);
+    stat_add(&st->latency_sum, ns);
+}
+
+// Hardware events counted with --perf-counters, as one group led by the first
+static const struct perf_counter_def {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+} perf_counter_defs[] = {
+    { "cycles",        PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "instructions",  PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { "cache_misses",  PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { "branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { "dtlb_misses",   PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                           (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+};
+#define PERF_COUNTERS (sizeof(perf_counter_defs) / sizeof(perf_counter_defs[0]))
+
+/*
+ * Counter group of one worker thread. Each client socket event is measured and its
+ * counts are split over the request types it handled, in proportion to their number.
+ */
+struct perf_group {
+    int fds[PERF_COUNTERS];
+    struct perf_event_mmap_page *pages[PERF_COUNTERS];
+    int rdpmc;                          // Every counter can be read in user space
+    uint64_t begin[PERF_COUNTERS];      // Counts when the current event started
+    uint64_t begin_cmds[CMD_COUNT];
+    _Atomic uint64_t counts[CMD_COUNT][PERF_COUNTERS]; // Written by the worker, read by the admin endpoint
+    _Atomic uint64_t requests[CMD_COUNT];
+};
+
+// A busiest connection as published for the admin endpoint
+struct top_entry {
+    int worker;
+    int fd;
+    uint32_t peer_addr;
+    uint16_t peer_port;
+    uint32_t win_msgs;
+    uint64_t msgs;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t last_active;
+    size_t queued;      // Unparsed input and unsent output
+    double rate;        // Requests per second, computed by the reader
+};
+
+/*
+ * Slow requests (--async-threads). Admin requests and BIN_SLEEP do not run on the
+ * event loop: the worker queues them to a pool of threads shared by all workers
+ * and goes on serving its other connections. A pool thread runs a job once it is
+ * due, pushes it to its worker's lock-free stack of finished jobs and signals the
+ * worker's async_fd; the worker then queues the response like any other (see
+ * worker_async). The pool only reads state that is published for other threads
+ * anyway, as the admin endpoint always has, never a connection. A job whose
+ * connection was closed in the meantime is dropped when it comes back.
+ */
+#define ASYNC_MAX_SLEEP_MS 10000 // Longest BIN_SLEEP
+
+struct async_job {
+    struct async_job *next;     // Pool queue, then the worker's stack of finished jobs
+    struct async_job *prev_w;   // Unfinished jobs of the worker (w->async_jobs)
+    struct async_job *next_w;
+    struct worker *w;
+    struct conn *c;             // NULL once the connection is closed
+    uint64_t due;               // now_ns() from which the job may run
+    int http;                   // An admin request over HTTP, a binary request otherwise
+    int found;                  // The admin path exists
+    struct bin_header h;        // The request, turned into the response header
+    char path[MAX_LINE];        // Admin path
+    struct buffer res;
+};
+
+/*
+ * Event loop thread. Every worker has its own reactor (epoll instance) and either its own
+ * SO_REUSEPORT listener, so the kernel spreads new connections, a share of one
+ * listener (--accept-mode exclusive), or an inbox the acceptor thread fills
+ * (--accept-mode handoff).
+ */
+struct worker {
+    int id;
+    int cpu;                    // CPU the worker is pinned to, -1 if not pinned
+    pthread_t tid;
+    int epfd;                   // epoll reactors
+    void *reactor_state;        // Other reactors
+    int listen_sock;            // Own listener, the shared one (exclusive mode) or -1 (handoff mode)
+    int wake_fd;                // eventfd signalled after connections were pushed to the inbox or a move was requested
+    struct fd_queue inbox;      // Accepted or migrated connections waiting to be registered by this worker
+    _Atomic int load;           // Open connections, including those still in the inbox
+    _Atomic uint64_t busy_ns;   // Time spent handling events, measured only when rebalancing or serving metrics
+    _Atomic(struct worker *) steal_to; // Set by the rebalancer: move part of the connections there
+    _Atomic int steal_permille; // Share of the recent requests the moved connections should carry
+    int async_fd;               // eventfd signalled after the async pool pushed finished jobs to async_done
+    _Atomic(struct async_job *) async_done; // Jobs finished by the pool, newest first
+    struct async_job *async_jobs; // Unfinished jobs of this worker, detached from their connection when it closes
+    struct conn *conn_list;     // Connections registered in the reactor
+    char *rbuf;                 // cfg.read_size bytes for read(), requests are parsed from here when possible
+    struct buffer_pool pool;    // Buffers for partial requests and pending output
+    struct epoll_event *events; // cfg.events entries for epoll_wait()
+    int admin_sock;             // Listener of the admin endpoint (worker 0), -1 otherwise
+    struct worker_stats stats;
+    struct perf_group *perf;    // --perf-counters, NULL if off or not available
+    struct trace_ring *trace;   // --trace, NULL if off
+    struct conn *top[TOP_CONNS]; // Busiest connections of the current window, most requests first
+    int ntop;
+    uint32_t epoch;             // Current ranking window
+    uint64_t window_start;
+    _Atomic unsigned top_seq;   // Seqlock of the published list, odd while it is being written
+    struct top_entry top_pub[TOP_CONNS]; // The list of the last complete window
+    int ntop_pub;
+    uint64_t top_pub_start;
+    uint64_t top_pub_end;
+} __attribute__((aligned(64))); // Counters of neighbouring workers do not share a cache line
+
+// All workers, for the admin endpoint
+static struct worker *server_workers = NULL;
+
+/*
+ * Connection table indexed by file descriptor, sized from RLIMIT_NOFILE so it never moves.
+ * The connections themselves live in a slab with one slot per file descriptor:
+ * conn_new() and conn_close() are a memset and a store, nothing goes through malloc
+ * under churn, and no two threads ever want the same slot, since the kernel hands
+ * out each fd once until it is closed. Its lowest-free-fd rule is the free list: a
+ * closed slot is the next one reused, so the touched part of the slab stays as small
+ * as the peak number of open connections. The slab is reserved, not committed;
+ * untouched slots cost no memory.
+ */
+static struct conn **conns = NULL;
+static struct conn *conn_slab = NULL;
+static int conns_cap = 0;
+
+static void conns_init(void) {
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > (1 << 24)) {
+        rl.rlim_cur = 1 << 24;
+    }
+
+    conns_cap = (int)rl.rlim_cur;
+    if ((conns = calloc(conns_cap, sizeof(*conns))) == NULL) {
+        perror("[!] calloc()");
+        exit(EXIT_FAILURE);
+    }
+
+    // Anonymous pages are page aligned, so every slot is cache line aligned
+    conn_slab = huge_map((size_t)conns_cap * sizeof(*conn_slab), 1, "connection slab");
+    if (conn_slab == MAP_FAILED) {
+        perror("[!] mmap()");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static struct conn *conn_new(int fd) {
+    struct conn *c = &conn_slab[fd];
+
+    memset(c, 0, sizeof(*c));
+    c->fd = fd;
+    conns[fd] = c;
+
+    return c;
+}
+
+static struct conn *conn_lookup(int fd) {
+    return fd >= 0 && fd < conns_cap ? conns[fd] : NULL;
+}
+
+// Connections borrow buffers from their current worker's pool, see struct buffer_pool
+static void conn_attach(struct worker *w, struct buffer *b) {
+    if (b->data == NULL) {
+        buffer_attach(&w->pool, b);
+        stat_add(&w->stats.buffers_attached, 1);
+    }
+}
+
+static void conn_release(struct worker *w, struct buffer *b) {
+    if (b->data != NULL) {
+        buffer_release(&w->pool, b);
+        stat_add(&w->stats.buffers_released, 1);
+    }
+}
+
+// Append to a connection buffer; data that does not fit into a pooled buffer moves it to a malloc()ed one
+static void conn_append(struct worker *w, struct buffer *b, const char *p, size_t n) {
+    struct buffer grown = { NULL, 0, 0, 0, 0 };
+
+    conn_attach(w, b);
+    if (b->kind != BUFFER_HEAP && buffer_size(b) + n > b->cap) {
+        if (buffer_size(b) > 0) { // memcpy() into a buffer without storage yet is undefined, even for 0 bytes
+            buffer_append(&grown, b->data + b->off, buffer_size(b));
+        }
+        buffer_release(&w->pool, b); // Still held by the connection, so not counted as released
+        *b = grown;
+    }
+    buffer_append(b, p, n);
+}
+
+/*
+ * Reactor backends. A worker registers its file descriptors and waits for
+ * readiness through one of these, and gets the ready ones back in w->events
+ * as epoll events, whatever the backend; the connection and protocol code is
+ * the same for all of them (--reactor):
+ *
+ *     epoll-et   epoll, edge-triggered where the caller asks for it (EPOLLET)
+ *     epoll-lt   epoll, always level-triggered
+ *     poll       poll() over an array of every registered descriptor
+ *     io_uring   one-shot IORING_OP_POLL_ADD per descriptor, re-armed after it was reported
+ *
+ * Level-triggered backends report a writable socket on every wait, so the worker
+ * only asks them for EPOLLOUT while responses are pending (see conn_watch()).
+ */
+struct reactor_ops {
+    const char *name;
+    int edge;                                              // EPOLLET is honoured
+    void (*init)(struct worker *w);
+    int (*add)(struct worker *w, int fd, uint32_t events); // -1 and errno on failure
+    void (*mod)(struct worker *w, int fd, uint32_t events);
+    void (*del)(struct worker *w, int fd);                 // Before the descriptor is closed
+    int (*wait)(struct worker *w);                         // Fill w->events, -1 and errno on failure
+    int (*send)(struct worker *w, struct conn *c);         // Completion I/O: send c->out, NULL to write()
+    void (*free)(struct worker *w);
+};
+
+static const struct reactor_ops *reactor = NULL;
+
+static void epoll_reactor_init(struct worker *w) {
+    // Create an epoll file descriptor (size parameter is deprecated but still required to be larger than 0)
+    if((w->epfd = epoll_create(1)) == -1) {
+        perror("[!] Cannot create epoll file descriptor\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static int epoll_reactor_ctl(struct worker *w, int op, int fd, uint32_t events) {
+    struct epoll_event ev;
+
+    ev.events = reactor->edge ? events : events & ~EPOLLET;
+    ev.data.fd = fd;
+    return epoll_ctl(w->epfd, op, fd, &ev);
+}
+
+static int epoll_reactor_add(struct worker *w, int fd, uint32_t events) {
+    return epoll_reactor_ctl(w, EPOLL_CTL_ADD, fd, events);
+}
+
+static void epoll_reactor_mod(struct worker *w, int fd, uint32_t events) {
+    epoll_reactor_ctl(w, EPOLL_CTL_MOD, fd, events);
+}
+
+static void epoll_reactor_del(struct worker *w, int fd) {
+    epoll_ctl(w->epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+static int epoll_reactor_wait(struct worker *w) {
+    // Wait for events on an epoll instance
+    // nfds: the number of file descriptors ready for the requested I/O operations (triggered events)
+    // events: the buffer where the triggered events are stored
+    return epoll_wait(w->epfd, w->events, cfg.events, -1);
+}
+
+static void epoll_reactor_free(struct worker *w) {
+    close(w->epfd); // Close the epoll file descriptor
+}
+
+/*
+ * poll(): the registered descriptors are kept dense in one pollfd array, with
+ * an index from descriptor to slot. A wait scans the whole array, and resumes
+ * the scan where the previous one stopped when more were ready than fit in
+ * w->events, so busy descriptors at the front cannot starve the rest.
+ */
+struct poll_reactor {
+    struct pollfd *fds;
+    int n;
+    int cap;
+    int *slot;      // Index into fds by descriptor, -1 if not registered
+    int slot_cap;
+    int next;       // Where the next scan starts
+};
+
+static void poll_reactor_init(struct worker *w) {
+    struct poll_reactor *p;
+
+    if ((p = calloc(1, sizeof(*p))) == NULL) {
+        perror("[!] calloc()");
+        exit(EXIT_FAILURE);
+    }
+    w->reactor_state = p;
+}
+
+static int poll_reactor_add(struct worker *w, int fd, uint32_t events) {
+    struct poll_reactor *p = w->reactor_state;
+    int cap;
+
+    if (fd >= p->slot_cap) {
+        cap = p->slot_cap ? p->slot_cap : 64;
+        while (cap <= fd) {
+            cap *= 2;
+        }
+        if ((p->slot = realloc(p->slot, cap * sizeof(*p->slot))) == NULL) {
+            perror("[!] realloc()");
+            exit(EXIT_FAILURE);
+        }
+        memset(p->slot + p->slot_cap, 0xff, (cap - p->slot_cap) * sizeof(*p->slot)); // -1
+        p->slot_cap = cap;
+    }
+
+    if (p->n == p->cap) {
+        p->cap = p->cap ? p->cap * 2 : 64;
+        if ((p->fds = realloc(p->fds, p->cap * sizeof(*p->fds))) == NULL) {
+            perror("[!] realloc()");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // EPOLLIN, EPOLLOUT, EPOLLRDHUP, ... have the values of their POLL* counterparts
+    p->fds[p->n].fd = fd;
+    p->fds[p->n].events = (short)(events & 0xffff);
+    p->fds[p->n].revents = 0;
+    p->slot[fd] = p->n++;
+    return 0;
+}
+
+static void poll_reactor_mod(struct worker *w, int fd, uint32_t events) {
+    struct poll_reactor *p = w->reactor_state;
+
+    p->fds[p->slot[fd]].events = (short)(events & 0xffff);
+}
+
+static void poll_reactor_del(struct worker *w, int fd) {
+    struct poll_reactor *p = w->reactor_state;
+    int i;
+
+    if (fd >= p->slot_cap || (i = p->slot[fd]) < 0) {
+        return;
+    }
+
+    // Keep the array dense by moving the last entry into the hole
+    p->fds[i] = p->fds[--p->n];
+    p->slot[p->fds[i].fd] = i;
+    p->slot[fd] = -1;
+}
+
+static int poll_reactor_wait(struct worker *w) {
+    struct poll_reactor *p = w->reactor_state;
+    int i;
+    int k;
+    int n = 0;
+    int ready;
+
+    if ((ready = poll(p->fds, p->n, -1)) < 0) {
+        return -1;
+    }
+
+    for (k = 0; k < p->n && n < ready && n < cfg.events; k++) {
+        i = (p->next + k) % p->n;
+        if (p->fds[i].revents != 0) {
+            w->events[n].events = (uint16_t)p->fds[i].revents;
+            w->events[n].data.fd = p->fds[i].fd;
+            n++;
+        }
+    }
+    p->next = p->n > 0 ? (p->next + k) % p->n : 0;
+
+    return n;
+}
+
+static void poll_reactor_free(struct worker *w) {
+    struct poll_reactor *p = w->reactor_state;
+
+    free(p->fds);
+    free(p->slot);
+    free(p);
+}
+
+/*
+ * Minimal io_uring, set up with the raw system calls: the submission and
+ * completion rings are shared with the kernel through mmap(), an SQE is
+ * published by advancing the SQ tail and a CQE consumed by advancing the
+ * CQ head, both with release stores paired with the kernel's acquire loads.
+ *
+ * With --uring-sqpoll a kernel thread polls the SQ, so submitting needs no
+ * system call while the thread is awake; it goes to sleep after the given
+ * idle time and then has to be woken with io_uring_enter().
+ */
+struct uring {
+    int fd;
+    int sqpoll;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_flags;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned to_submit;  // Published SQEs the kernel has not consumed yet (without SQPOLL)
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+};
+
+static void uring_init(struct uring *r, unsigned entries, unsigned cq_entries) {
+    unsigned i;
+    unsigned *array;
+    struct io_uring_params p;
+
+    bzero(&p, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = cq_entries;
+    if (cfg.uring_sqpoll > 0) {
+        p.flags |= IORING_SETUP_SQPOLL;
+        p.sq_thread_idle = cfg.uring_sqpoll;
+        if (cfg.uring_sqpoll_cpu >= 0) { // Keep the poller off the worker's CPU
+            p.flags |= IORING_SETUP_SQ_AFF;
+            p.sq_thread_cpu = cfg.uring_sqpoll_cpu;
+        }
+    }
+    if ((r->fd = syscall(SYS_io_uring_setup, entries, &p)) < 0) {
+        perror("[!] io_uring_setup()");
+        exit(EXIT_FAILURE);
+    }
+    r->sqpoll = cfg.uring_sqpoll > 0;
+
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) { // Both rings share one mapping since Linux 5.4
+        if (r->cq_ring_size > r->sq_ring_size) {
+            r->sq_ring_size = r->cq_ring_size;
+        }
+        r->cq_ring_size = r->sq_ring_size;
+    }
+
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      r->fd, IORING_OFF_SQ_RING);
+    r->cq_ring = (p.features & IORING_FEAT_SINGLE_MMAP) ? r->sq_ring :
+                 mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      r->fd, IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sq_ring == MAP_FAILED || r->cq_ring == MAP_FAILED || r->sqes == MAP_FAILED) {
+        perror("[!] mmap(io_uring)");
+        exit(EXIT_FAILURE);
+    }
+
+    r->sq_head = (unsigned *)((char *)r->sq_ring + p.sq_off.head);
+    r->sq_tail = (unsigned *)((char *)r->sq_ring + p.sq_off.tail);
+    r->sq_flags = (unsigned *)((char *)r->sq_ring + p.sq_off.flags);
+    r->sq_mask = *(unsigned *)((char *)r->sq_ring + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    r->cq_head = (unsigned *)((char *)r->cq_ring + p.cq_off.head);
+    r->cq_tail = (unsigned *)((char *)r->cq_ring + p.cq_off.tail);
+    r->cq_mask = *(unsigned *)((char *)r->cq_ring + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)((char *)r->cq_ring + p.cq_off.cqes);
+    r->to_submit = 0;
+
+    // SQ slot i always holds SQE i, so an SQE is used in ring order
+    array = (unsigned *)((char *)r->sq_ring + p.sq_off.array);
+    for (i = 0; i < p.sq_entries; i++) {
+        array[i] = i;
+    }
+}
+
+static int uring_enter(struct uring *r, unsigned min_complete, unsigned flags) {
+    int n;
+
+    if (min_complete > 0) {
+        flags |= IORING_ENTER_GETEVENTS;
+    }
+    n = syscall(SYS_io_uring_enter, r->fd, r->to_submit, min_complete, flags, NULL, 0);
+    if (n > 0) {
+        r->to_submit -= n;
+    }
+
+    return n;
+}
+
+// Make sure the SQ poller sees the published SQEs, the only system call it may need
+static void uring_kick(struct uring *r) {
+    if (!r->sqpoll) {
+        return; // Submitted by the next io_uring_enter()
+    }
+
+    // The tail store must be visible before the flag is read, or the poller could miss it
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(r->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP) {
+        uring_enter(r, 0, IORING_ENTER_SQ_WAKEUP);
+    }
+}
+
+// Have the kernel take every published SQE now, not at the next wait
+static void uring_drain_sq(struct uring *r) {
+    uring_kick(r);
+    while (*r->sq_tail != __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE)) {
+        if (uring_enter(r, 0, r->sqpoll ? IORING_ENTER_SQ_WAIT : 0) < 0 && errno != EINTR && errno != EAGAIN) {
+            break;
+        }
+    }
+}
+
+// Next free SQE, cleared; it is handed to the kernel by uring_publish()
+static struct io_uring_sqe *uring_sqe(struct uring *r) {
+    struct io_uring_sqe *sqe;
+    unsigned tail = *r->sq_tail;
+
+    // Full: let the kernel consume what is queued first
+    while (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) == r->sq_entries) {
+        uring_kick(r);
+        if (uring_enter(r, 0, r->sqpoll ? IORING_ENTER_SQ_WAIT : 0) < 0 &&
+            errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            perror("[!] io_uring_enter()");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    sqe = &r->sqes[tail & r->sq_mask];
+    bzero(sqe, sizeof(*sqe));
+    return sqe;
+}
+
+static void uring_publish(struct uring *r) {
+    __atomic_store_n(r->sq_tail, *r->sq_tail + 1, __ATOMIC_RELEASE);
+    if (!r->sqpoll) {
+        r->to_submit++;
+    }
+}
+
+static int uring_cq_empty(struct uring *r) {
+    return *r->cq_head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Wait until there is at least one completion. With SQPOLL the ring is polled
+ * for as long as the SQ thread stays awake, so a busy loop makes no system
+ * calls; completions the CQ had no room for are flushed with io_uring_enter().
+ */
+static int uring_wait(struct uring *r) {
+    int spins = 0;
+    uint64_t deadline;
+
+    if (!r->sqpoll) {
+        // Submit the queued SQEs, and block only if nothing has completed yet
+        if (uring_cq_empty(r)) {
+            return uring_enter(r, 1, 0);
+        }
+        return r->to_submit > 0 ? uring_enter(r, 0, 0) : 0;
+    }
+
+    uring_kick(r);
+    deadline = now_ns() + (uint64_t)cfg.uring_sqpoll * 1000000;
+    while (uring_cq_empty(r)) {
+        if (__atomic_load_n(r->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW) {
+            return uring_enter(r, 1, 0);
+        }
+        if (++spins % 1024 == 0 && now_ns() > deadline) {
+            return uring_enter(r, 1, 0);
+        }
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+
+    return 0;
+}
+
+static void uring_free(struct uring *r) {
+    munmap(r->sqes, r->sq_entries * sizeof(struct io_uring_sqe));
+    if (r->cq_ring != r->sq_ring) {
+        munmap(r->cq_ring, r->cq_ring_size);
+    }
+    munmap(r->sq_ring, r->sq_ring_size);
+    close(r->fd);
+}
+
+/*
+ * io_uring readiness: a one-shot poll request per descriptor, which the kernel
+ * completes with the ready events. Reported descriptors are re-armed at the
+ * start of the next wait, after the worker handled them, so the backend is
+ * level-triggered and a socket that still has data is simply reported again.
+ *
+ * io_uring-fixed does the connection I/O itself instead. Every connection is
+ * installed in a registered (fixed) file table, at the index of its descriptor,
+ * and has one multishot receive that takes buffers from a buffer ring shared
+ * with the kernel (the registered buffer pool). Received data is appended to
+ * the connection's input and reported as EPOLLIN; responses are sent from a
+ * buffer the backend owns until the send completes. Listeners, eventfds and
+ * stdin are still polled.
+ *
+ * user_data carries the request type in its low two bits. Polls and receives
+ * also carry the descriptor and a generation that changes whenever the
+ * registration does, so completions of removed requests are recognised and
+ * dropped; sends carry their struct uring_tx.
+ */
+#define URING_POLL   0
+#define URING_RECV   1
+#define URING_SEND   2
+#define URING_IGNORE UINT64_MAX // Cancellations, their completions carry nothing
+
+struct uring_tx {
+    struct buffer b;    // Bytes being sent, swapped with the connection's output
+    int fd;
+};
+
+struct uring_fd {
+    uint32_t events;    // Registered interest, 0 if not registered
+    uint32_t gen;
+    int armed;          // A poll or receive is in flight
+    int fixed;          // A connection in the fixed file table (io_uring-fixed)
+    int reported;       // Reported by the current wait, at w->events[slot]
+    int slot;
+    int sending;        // tx is being sent
+    struct uring_tx *tx;
+};
+
+struct uring_reactor {
+    struct uring ring;
+    struct uring_fd *fds;   // By descriptor
+    int cap;
+    int *rearm;             // Descriptors reported by the last wait
+    int nrearm;
+    struct io_uring_buf_ring *br; // Receive buffers (io_uring-fixed)
+    char *bufs;
+    unsigned nbufs;
+    unsigned br_tail;
+};
+
+static uint64_t uring_ud(int type, int fd, uint32_t gen) {
+    return (uint64_t)gen << 32 | (uint64_t)fd << 2 | type;
+}
+
+static int uring_register(struct uring *r, unsigned op, void *arg, unsigned n) {
+    return syscall(SYS_io_uring_register, r->fd, op, arg, n);
+}
+
+static void uring_reactor_init(struct worker *w) {
+    struct uring_reactor *u;
+
+    if ((u = calloc(1, sizeof(*u))) == NULL || (u->rearm = calloc(cfg.events, sizeof(*u->rearm))) == NULL) {
+        perror("[!] calloc()");
+        exit(EXIT_FAILURE);
+    }
+    // Polls in flight do not take CQ entries, only the completions harvested per wait do
+    uring_init(&u->ring, 256, 4 * (cfg.events > 256 ? cfg.events : 256));
+    w->reactor_state = u;
+}
+
+// Hand a receive buffer (back) to the kernel, published by uring_bufs_publish()
+static void uring_buf_recycle(struct uring_reactor *u, unsigned bid) {
+    struct io_uring_buf *b = &u->br->bufs[u->br_tail & (u->nbufs - 1)];
+
+    b->addr = (uint64_t)(uintptr_t)(u->bufs + (size_t)bid * cfg.read_size);
+    b->len = cfg.read_size;
+    b->bid = bid;
+    u->br_tail++;
+}
+
+static void uring_bufs_publish(struct uring_reactor *u) {
+    __atomic_store_n(&u->br->tail, (uint16_t)u->br_tail, __ATOMIC_RELEASE);
+}
+
+static void uring_fixed_init(struct worker *w) {
+    unsigned i;
+    struct uring_reactor *u;
+    struct io_uring_rsrc_register files;
+    struct io_uring_buf_reg reg;
+
+    uring_reactor_init(w);
+    u = w->reactor_state;
+
+    // A sparse table with a slot for every descriptor the connection table can hold, up to the kernel's limit
+    bzero(&files, sizeof(files));
+    files.nr = conns_cap < (1 << 20) ? conns_cap : (1 << 20);
+    files.flags = IORING_RSRC_REGISTER_SPARSE;
+    if (uring_register(&u->ring, IORING_REGISTER_FILES2, &files, sizeof(files)) < 0) {
+        perror("[!] IORING_REGISTER_FILES2");
+        exit(EXIT_FAILURE);
+    }
+
+    // Buffers of cfg.read_size bytes, and the ring the kernel picks them from
+    u->nbufs = 1;
+    while (u->nbufs < (unsigned)cfg.uring_buffers) {
+        u->nbufs *= 2;
+    }
+    u->br = mmap(NULL, u->nbufs * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (u->br == MAP_FAILED || (u->bufs = malloc((size_t)u->nbufs * cfg.read_size)) == NULL) {
+        perror("[!] receive buffers");
+        exit(EXIT_FAILURE);
+    }
+
+    bzero(&reg, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)u->br;
+    reg.ring_entries = u->nbufs;
+    reg.bgid = 0;
+    if (uring_register(&u->ring, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        perror("[!] IORING_REGISTER_PBUF_RING");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < u->nbufs; i++) {
+        uring_buf_recycle(u, i);
+    }
+    uring_bufs_publish(u);
+}
+
+static struct uring_fd *uring_reactor_fd(struct uring_reactor *u, int fd) {
+    int cap;
+
+    if (fd >= u->cap) {
+        cap = u->cap ? u->cap : 64;
+        while (cap <= fd) {
+            cap *= 2;
+        }
+        if ((u->fds = realloc(u->fds, cap * sizeof(*u->fds))) == NULL) {
+            perror("[!] realloc()");
+            exit(EXIT_FAILURE);
+        }
+        bzero(u->fds + u->cap, (cap - u->cap) * sizeof(*u->fds));
+        u->cap = cap;
+    }
+
+    return &u->fds[fd];
+}
+
+static void uring_reactor_arm(struct uring_reactor *u, int fd) {
+    struct uring_fd *f = &u->fds[fd];
+    struct io_uring_sqe *sqe = uring_sqe(&u->ring);
+
+    if (f->fixed) { // Multishot receive into the buffer ring, by fixed file index
+        sqe->opcode = IORING_OP_RECV;
+        sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->buf_group = 0;
+        sqe->user_data = uring_ud(URING_RECV, fd, f->gen);
+    } else {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->poll32_events = f->events & ~(EPOLLET | EPOLLEXCLUSIVE);
+        sqe->user_data = uring_ud(URING_POLL, fd, f->gen);
+    }
+    sqe->fd = fd;
+    uring_publish(&u->ring);
+    f->armed = 1;
+}
+
+static void uring_reactor_disarm(struct uring_reactor *u, int fd) {
+    struct uring_fd *f = &u->fds[fd];
+    struct io_uring_sqe *sqe;
+
+    if (f->armed) {
+        sqe = uring_sqe(&u->ring);
+        sqe->opcode = f->fixed ? IORING_OP_ASYNC_CANCEL : IORING_OP_POLL_REMOVE;
+        sqe->addr = uring_ud(f->fixed ? URING_RECV : URING_POLL, fd, f->gen);
+        sqe->user_data = URING_IGNORE;
+        uring_publish(&u->ring);
+        f->armed = 0;
+    }
+    f->gen++;
+}
+
+static int uring_reactor_add(struct worker *w, int fd, uint32_t events) {
+    struct uring_reactor *u = w->reactor_state;
+
+    uring_reactor_fd(u, fd)->events = events;
+    uring_reactor_arm(u, fd);
+    return 0;
+}
+
+static int uring_fixed_add(struct worker *w, int fd, uint32_t events) {
+    struct uring_reactor *u = w->reactor_state;
+    struct uring_fd *f;
+    struct io_uring_files_update upd;
+
+    if (conn_lookup(fd) == NULL) { // Not a connection
+        return uring_reactor_add(w, fd, events);
+    }
+
+    // Install the socket at the index of its descriptor
+    bzero(&upd, sizeof(upd));
+    upd.offset = fd;
+    upd.fds = (uint64_t)(uintptr_t)&fd;
+    if (uring_register(&u->ring, IORING_REGISTER_FILES_UPDATE, &upd, 1) < 0) {
+        return -1;
+    }
+
+    f = uring_reactor_fd(u, fd);
+    f->events = events;
+    f->fixed = 1;
+    uring_reactor_arm(u, fd);
+    uring_kick(&u->ring);
+    return 0;
+}
+
+static void uring_reactor_mod(struct worker *w, int fd, uint32_t events) {
+    struct uring_reactor *u = w->reactor_state;
+
+    if (u->fds[fd].fixed) {
+        return; // Connections of io_uring-fixed do not wait for readiness
+    } else if (u->fds[fd].armed) {
+        uring_reactor_disarm(u, fd);
+        u->fds[fd].events = events;
+        uring_reactor_arm(u, fd);
+    } else {
+        u->fds[fd].events = events; // Reported by the last wait, re-armed with the new interest
+    }
+}
+
+static void uring_reactor_del(struct worker *w, int fd) {
+    struct uring_reactor *u = w->reactor_state;
+    struct uring_fd *f;
+    struct io_uring_files_update upd;
+    int none = -1;
+
+    if (fd >= u->cap || u->fds[fd].events == 0) {
+        return;
+    }
+
+    f = &u->fds[fd];
+    uring_reactor_disarm(u, fd);
+    f->events = 0;
+    if (f->fixed) {
+        // A send takes its file when issued, so one still queued has to be issued before the slot is cleared
+        if (f->sending) {
+            uring_drain_sq(&u->ring);
+        }
+
+        // The table holds a reference to the socket, which has to go for close() to take effect
+        bzero(&upd, sizeof(upd));
+        upd.offset = fd;
+        upd.fds = (uint64_t)(uintptr_t)&none;
+        uring_register(&u->ring, IORING_REGISTER_FILES_UPDATE, &upd, 1);
+        f->fixed = 0;
+
+        // A send in flight still reads its buffer, the completion frees it
+        if (f->tx != NULL && !f->sending) {
+            conn_release(w, &f->tx->b);
+            free(f->tx);
+        }
+        f->tx = NULL;
+        f->sending = 0;
+    }
+}
+
+static void uring_fixed_submit(struct uring_reactor *u, struct uring_tx *tx) {
+    struct io_uring_sqe *sqe = uring_sqe(&u->ring);
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = tx->fd;
+    sqe->addr = (uint64_t)(uintptr_t)(tx->b.data + tx->b.off);
+    sqe->len = buffer_size(&tx->b);
+    sqe->user_data = (uint64_t)(uintptr_t)tx | URING_SEND;
+    uring_publish(&u->ring);
+}
+
+// Start sending the pending responses, unless a send is already in flight (it continues on completion)
+static int uring_fixed_send(struct worker *w, struct conn *c) {
+    struct uring_reactor *u = w->reactor_state;
+    struct uring_fd *f = &u->fds[c->fd];
+    struct buffer b;
+
+    if (f->sending || buffer_size(&c->out) == 0) {
+        return 0;
+    }
+
+    if (f->tx == NULL) {
+        if ((f->tx = calloc(1, sizeof(*f->tx))) == NULL) {
+            perror("[!] calloc()");
+            exit(EXIT_FAILURE);
+        }
+        f->tx->fd = c->fd;
+    }
+
+    // New responses keep going to the connection's output while this one is sent
+    b = f->tx->b;
+    f->tx->b = c->out;
+    c->out = b;
+
+    f->sending = 1;
+    uring_fixed_submit(u, f->tx);
+    uring_kick(&u->ring);
+    return 0;
+}
+
+// Report events for a descriptor once per wait
+static void uring_report(struct worker *w, struct uring_reactor *u, int fd, uint32_t events, int *n) {
+    struct uring_fd *f = &u->fds[fd];
+
+    if (f->reported) {
+        w->events[f->slot].events |= events;
+        return;
+    }
+
+    f->reported = 1;
+    f->slot = *n;
+    w->events[*n].events = events;
+    w->events[*n].data.fd = fd;
+    u->rearm[u->nrearm++] = fd;
+    (*n)++;
+}
+
+static void uring_complete_recv(struct worker *w, struct uring_reactor *u, struct io_uring_cqe *cqe,
+                                int fd, int *n) {
+    struct uring_fd *f = &u->fds[fd];
+    unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    int live = fd < u->cap && f->fixed && f->gen == (uint32_t)(cqe->user_data >> 32);
+
+    if (live && !(cqe->flags & IORING_CQE_F_MORE)) {
+        f->armed = 0; // Re-armed after the wait, unless the connection is gone by then
+    }
+
+    if (cqe->res > 0 && live) {
+        conn_append(w, &conns[fd]->in, u->bufs + (size_t)bid * cfg.read_size, cqe->res); // Parsed after the wait
+        stat_add(&w->stats.bytes_in, cqe->res);
+        conns[fd]->bytes_in += cqe->res;
+        TRACE(w, TRACE_RECV, fd, cqe->res);
+        uring_report(w, u, fd, EPOLLIN, n);
+    } else if (cqe->res == 0 && live) {
+        uring_report(w, u, fd, EPOLLIN | EPOLLRDHUP, n);
+    } else if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED && live) {
+        uring_report(w, u, fd, EPOLLERR, n);
+    } else if (live && !f->armed) {
+        uring_report(w, u, fd, 0, n); // Out of buffers: only re-arm
+    }
+
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        uring_buf_recycle(u, bid);
+    }
+}
+
+static void uring_complete_send(struct worker *w, struct uring_reactor *u, struct io_uring_cqe *cqe, int *n) {
+    struct uring_tx *tx = (struct uring_tx *)(uintptr_t)(cqe->user_data & ~(uint64_t)3);
+    struct uring_fd *f = &u->fds[tx->fd];
+    struct conn *c;
+
+    if (cqe->res > 0) {
+        stat_add(&w->stats.bytes_out, cqe->res);
+    }
+
+    if (f->tx != tx) { // The connection is gone
+        conn_release(w, &tx->b);
+        free(tx);
+        return;
+    }
+
+    if (cqe->res < 0) {
+        f->sending = 0;
+        uring_report(w, u, tx->fd, EPOLLERR, n);
+        return;
+    }
+
+    buffer_consume(&tx->b, cqe->res);
+    if ((c = conns[tx->fd]) != NULL) {
+        c->bytes_out += cqe->res;
+    }
+    if (buffer_size(&tx->b) > 0) { // Short send
+        uring_fixed_submit(u, tx);
+        return;
+    }
+
+    // Responses queued meanwhile go out with the same tx, otherwise the connection holds no send state
+    f->sending = 0;
+    conn_release(w, &tx->b);
+    if (c != NULL && buffer_size(&c->out) > 0) {
+        uring_fixed_send(w, c);
+    } else {
+        free(tx);
+        f->tx = NULL;
+    }
+}
+
+static int uring_reactor_wait(struct worker *w) {
+    struct uring_reactor *u = w->reactor_state;
+    struct uring *r = &u->ring;
+    struct io_uring_cqe *cqe;
+    struct uring_fd *f;
+    unsigned head;
+    int i;
+    int fd;
+    int n = 0;
+
+    for (i = 0; i < u->nrearm; i++) {
+        f = &u->fds[u->rearm[i]];
+        f->reported = 0;
+        if (f->events != 0 && !f->armed) {
+            uring_reactor_arm(u, u->rearm[i]);
+        }
+    }
+    u->nrearm = 0;
+
+    if (uring_wait(r) < 0) {
+        return -1;
+    }
+
+    head = *r->cq_head;
+    while (n < cfg.events && head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        cqe = &r->cqes[head & r->cq_mask];
+        head++;
+
+        fd = (int)((cqe->user_data >> 2) & 0x3fffffff);
+        if (cqe->user_data == URING_IGNORE) {
+            continue;
+        } else if ((cqe->user_data & 3) == URING_SEND) {
+            uring_complete_send(w, u, cqe, &n);
+        } else if ((cqe->user_data & 3) == URING_RECV) {
+            uring_complete_recv(w, u, cqe, fd, &n);
+        } else if (fd < u->cap && u->fds[fd].gen == (uint32_t)(cqe->user_data >> 32)) {
+            u->fds[fd].armed = 0;
+            uring_report(w, u, fd, cqe->res < 0 ? EPOLLERR : (uint32_t)cqe->res, &n);
+        } // Otherwise a poll that completed before its descriptor was re-registered
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    if (u->br != NULL) {
+        uring_bufs_publish(u);
+    }
+
+    return n;
+}
+
+static void uring_reactor_free(struct worker *w) {
+    struct uring_reactor *u = w->reactor_state;
+    struct io_uring_sync_cancel_reg cancel;
+
+    // Requests in flight hold their files, and a listener that outlives the process blocks a restart
+    bzero(&cancel, sizeof(cancel));
+    cancel.flags = IORING_ASYNC_CANCEL_ANY;
+    cancel.timeout.tv_sec = -1;
+    cancel.timeout.tv_nsec = -1;
+    uring_register(&u->ring, IORING_REGISTER_SYNC_CANCEL, &cancel, 1);
+    if (u->br != NULL) {
+        uring_register(&u->ring, IORING_UNREGISTER_FILES, NULL, 0);
+    }
+    uring_free(&u->ring);
+    if (u->br != NULL) {
+        munmap(u->br, u->nbufs * sizeof(struct io_uring_buf));
+        free(u->bufs);
+    }
+    free(u->fds);
+    free(u->rearm);
+    free(u);
+}
+
+// In the order of reactor_names
+static const struct reactor_ops reactors[] = {
+    { "epoll-et", 1, epoll_reactor_init, epoll_reactor_add, epoll_reactor_mod, epoll_reactor_del,
+      epoll_reactor_wait, NULL, epoll_reactor_free },
+    { "epoll-lt", 0, epoll_reactor_init, epoll_reactor_add, epoll_reactor_mod, epoll_reactor_del,
+      epoll_reactor_wait, NULL, epoll_reactor_free },
+    { "poll", 0, poll_reactor_init, poll_reactor_add, poll_reactor_mod, poll_reactor_del,
+      poll_reactor_wait, NULL, poll_reactor_free },
+    { "io_uring", 0, uring_reactor_init, uring_reactor_add, uring_reactor_mod, uring_reactor_del,
+      uring_reactor_wait, NULL, uring_reactor_free },
+    { "io_uring-fixed", 1, uring_fixed_init, uring_fixed_add, uring_reactor_mod, uring_reactor_del,
+      uring_reactor_wait, uring_fixed_send, uring_reactor_free },
+};
+
+static void reactor_add(struct worker *w, int fd, uint32_t events) {
+    if (reactor->add(w, fd, events) < 0) {
+        perror("[!] reactor add");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Busiest connections per worker, maintained incrementally. After every event a
+ * connection's requests in the current window are compared with the last entry of
+ * a short sorted list and, if larger, bubbled into place, so the cost does not grow
+ * with the number of connections. When a window ends the worker publishes a copy of
+ * the list under a seqlock and starts the next one; the admin endpoint only reads
+ * the published copies.
+ */
+static void conn_rank(struct worker *w, struct conn *c, uint64_t now) {
+    int i;
+
+    c->last_active = now;
+    if (c->win_epoch != w->epoch) {
+        c->win_epoch = w->epoch;
+        c->win_msgs = 0;
+    }
+    c->win_msgs += c->msgs - c->msgs_ranked;
+    c->msgs_ranked = c->msgs;
+
+    if (c->top_rank > 0) {
+        i = c->top_rank - 1;
+    } else if (w->ntop < TOP_CONNS) {
+        i = w->ntop++;
+    } else if (c->win_msgs > w->top[TOP_CONNS - 1]->win_msgs) {
+        i = TOP_CONNS - 1;
+        w->top[i]->top_rank = 0; // Pushed out by this one
+    } else {
+        return;
+    }
+
+    while (i > 0 && w->top[i - 1]->win_msgs < c->win_msgs) {
+        w->top[i] = w->top[i - 1];
+        w->top[i]->top_rank = i + 1;
+        i--;
+    }
+    w->top[i] = c;
+    c->top_rank = i + 1;
+}
+
+static void conn_unrank(struct worker *w, struct conn *c) {
+    int i;
+
+    if (c->top_rank == 0) {
+        return;
+    }
+
+    for (i = c->top_rank - 1; i < w->ntop - 1; i++) {
+        w->top[i] = w->top[i + 1];
+        w->top[i]->top_rank = i + 1;
+    }
+    w->ntop--;
+    c->top_rank = 0;
+}
+
+// Publish the list of the window that ended and start a new one
+static void worker_rotate_top(struct worker *w, uint64_t now) {
+    int i;
+    struct conn *c;
+    struct top_entry *e;
+    struct sockaddr_in addr;
+    socklen_t len;
+
+    atomic_store_explicit(&w->top_seq, atomic_load_explicit(&w->top_seq, memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    for (i = 0; i < w->ntop; i++) {
+        c = w->top[i];
+        if (c->peer_port == 0) {
+            len = sizeof(addr);
+            if (getpeername(c->fd, (struct sockaddr *)&addr, &len) == 0) {
+                c->peer_addr = addr.sin_addr.s_addr;
+                c->peer_port = ntohs(addr.sin_port);
+            }
+        }
+
+        e = &w->top_pub[i];
+        e->worker = w->id;
+        e->fd = c->fd;
+        e->peer_addr = c->peer_addr;
+        e->peer_port = c->peer_port;
+        e->win_msgs = c->win_msgs;
+        e->msgs = c->msgs;
+        e->bytes_in = c->bytes_in;
+        e->bytes_out = c->bytes_out;
+        e->last_active = c->last_active;
+        e->queued = buffer_size(&c->in) + buffer_size(&c->out);
+        c->top_rank = 0;
+    }
+    w->ntop_pub = w->ntop;
+    w->top_pub_start = w->window_start;
+    w->top_pub_end = now;
+
+    atomic_store_explicit(&w->top_seq, atomic_load_explicit(&w->top_seq, memory_order_relaxed) + 1,
+                          memory_order_release);
+
+    w->ntop = 0;
+    w->epoch++;
+    w->window_start = now;
+}
+
+static void conn_link(struct worker *w, struct conn *c) {
+    c->prev = NULL;
+    c->next = w->conn_list;
+    if (c->next != NULL) {
+        c->next->prev = c;
+    }
+    w->conn_list = c;
+}
+
+static void conn_unlink(struct worker *w, struct conn *c) {
+    conn_unrank(w, c);
+    if (c->prev != NULL) {
+        c->prev->next = c->next;
+    } else {
+        w->conn_list = c->next;
+    }
+    if (c->next != NULL) {
+        c->next->prev = c->prev;
+    }
+}
+
+static void conn_close(struct worker *w, struct conn *c) {
+    struct async_job *job;
+
+    if (verbose) {
+        printf("[+] connection closed\n");
+    }
+
+    if (!c->admin) {
+        stat_add(&w->stats.closed, 1);
+    }
+    TRACE(w, TRACE_CLOSE, c->fd, 0);
+
+    // Remove the file descriptor from the events queue
+    reactor->del(w, c->fd);
+
+    // Release the slot first: once closed, another thread may accept a connection with the same fd
+    // and take over its slab slot, so c must not be touched after close()
+    conns[c->fd] = NULL;
+    conn_unlink(w, c);
+    conn_release(w, &c->in);
+    conn_release(w, &c->out);
+
+    // Requests still in the async pool have nowhere to go, they are dropped when they come back
+    for (job = w->async_jobs; c->async > 0 && job != NULL; job = job->next_w) {
+        if (job->c == c) {
+            job->c = NULL;
+            c->async--;
+        }
+    }
+
+    // Close the file descriptor of the client socket
+    close(c->fd);
+
+    atomic_fetch_sub_explicit(&w->load, 1, memory_order_relaxed);
+}
+
+/*
+ * Admin endpoint (--admin-port): a listener of worker 0 whose connections are served by
+ * the same event loop as the clients. A request is an HTTP GET; /metrics returns the
+ * counters of every worker in the Prometheus text format. The counters are summed
+ * while the workers keep updating them, without taking anything the data path uses.
+ */
+#define ADMIN_REQUEST 1 // Waiting for the request line
+#define ADMIN_HEADERS 2 // Response queued, skipping the request headers
+#define ADMIN_DONE    3 // Closed once the response is sent
+
+static void buffer_printf(struct buffer *b, const char *fmt, ...) {
+    char line[512];
+    int n;
+    va_list ap;
+
+    va_start(ap, fmt);
+    n = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+
+    if (n > 0) {
+        buffer_append(b, line, (size_t)n < sizeof(line) ? (size_t)n : sizeof(line) - 1);
+    }
+}
+
+static void metric_header(struct buffer *b, const char *name, const char *type, const char *help) {
+    buffer_printf(b, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static uint64_t stat_sum(size_t offset) {
+    int i;
+    uint64_t sum = 0;
+
+    for (i = 0; i < cfg.workers; i++) {
+        sum += atomic_load_explicit((_Atomic uint64_t *)((char *)&server_workers[i].stats + offset),
+                                    memory_order_relaxed);
+    }
+
+    return sum;
+}
+
+#define STAT_SUM(field) stat_sum(offsetof(struct worker_stats, field))
+
+// Hardware counts per request type (--perf-counters), summed over the workers that have them
+static void metrics_perf(struct buffer *b) {
+    int w;
+    size_t i;
+    size_t k;
+    uint64_t sum;
+
+    metric_header(b, "epoll_perf_requests_total", "counter", "Requests measured with hardware counters.");
+    for (k = 0; k < CMD_COUNT; k++) {
+        sum = 0;
+        for (w = 0; w < cfg.workers; w++) {
+            if (server_workers[w].perf != NULL) {
+                sum += atomic_load_explicit(&server_workers[w].perf->requests[k], memory_order_relaxed);
+            }
+        }
+        buffer_printf(b, "epoll_perf_requests_total{command=\"%s\"} %lu\n", cmd_names[k], sum);
+    }
+
+    metric_header(b, "epoll_perf_events_total", "counter", "Hardware events while handling requests.");
+    for (k = 0; k < CMD_COUNT; k++) {
+        for (i = 0; i < PERF_COUNTERS; i++) {
+            sum = 0;
+            for (w = 0; w < cfg.workers; w++) {
+                if (server_workers[w].perf != NULL) {
+                    sum += atomic_load_explicit(&server_workers[w].perf->counts[k][i], memory_order_relaxed);
+                }
+            }
+            buffer_printf(b, "epoll_perf_events_total{command=\"%s\",event=\"%s\"} %lu\n",
+                          cmd_names[k], perf_counter_defs[i].name, sum);
+        }
+    }
+}
+
+static void metrics_write(struct buffer *b) {
+    int i;
+    size_t k;
+    uint64_t count = 0;
+    uint64_t accepted = STAT_SUM(accepted);
+    uint64_t closed = STAT_SUM(closed);
+    uint64_t attached;
+    uint64_t released;
+    uint64_t started;
+    uint64_t finished;
+
+    metric_header(b, "epoll_connections_open", "gauge", "Client connections currently open.");
+    buffer_printf(b, "epoll_connections_open %lu\n", accepted > closed ? accepted - closed : 0);
+    metric_header(b, "epoll_connections_accepted_total", "counter", "Client connections accepted.");
+    buffer_printf(b, "epoll_connections_accepted_total %lu\n", accepted);
+    metric_header(b, "epoll_connections_closed_total", "counter", "Client connections closed.");
+    buffer_printf(b, "epoll_connections_closed_total %lu\n", closed);
+    metric_header(b, "epoll_received_bytes_total", "counter", "Bytes received, admin requests included.");
+    buffer_printf(b, "epoll_received_bytes_total %lu\n", STAT_SUM(bytes_in));
+    metric_header(b, "epoll_sent_bytes_total", "counter", "Bytes sent, admin responses included.");
+    buffer_printf(b, "epoll_sent_bytes_total %lu\n", STAT_SUM(bytes_out));
+
+    metric_header(b, "epoll_commands_total", "counter", "Requests handled, by command.");
+    for (k = 0; k < CMD_COUNT; k++) {
+        buffer_printf(b, "epoll_commands_total{command=\"%s\"} %lu\n", cmd_names[k], STAT_SUM(commands[k]));
+    }
+
+    attached = STAT_SUM(buffers_attached);
+    released = STAT_SUM(buffers_released);
+    metric_header(b, "epoll_buffers_attached", "gauge", "Pooled buffers held by connections with partial input or pending output.");
+    buffer_printf(b, "epoll_buffers_attached %lu\n", attached > released ? attached - released : 0);
+    metric_header(b, "epoll_buffer_attaches_total", "counter", "Buffers taken from the pools by connections.");
+    buffer_printf(b, "epoll_buffer_attaches_total %lu\n", attached);
+
+    started = STAT_SUM(async_started);
+    finished = STAT_SUM(async_finished);
+    metric_header(b, "epoll_async_requests_in_flight", "gauge", "Requests handed to the async pool and not yet back.");
+    buffer_printf(b, "epoll_async_requests_in_flight %lu\n", started > finished ? started - finished : 0);
+    metric_header(b, "epoll_async_requests_total", "counter", "Requests handed to the async pool.");
+    buffer_printf(b, "epoll_async_requests_total %lu\n", started);
+
+    metric_header(b, "epoll_wakeups_total", "counter", "Returns from the reactor wait.");
+    buffer_printf(b, "epoll_wakeups_total %lu\n", STAT_SUM(wakeups));
+    metric_header(b, "epoll_events_total", "counter", "Events reported by the reactors.");
+    buffer_printf(b, "epoll_events_total %lu\n", STAT_SUM(events));
+
+    metric_header(b, "epoll_worker_busy_seconds_total", "counter", "Time the worker spent handling events.");
+    for (i = 0; i < cfg.workers; i++) {
+        buffer_printf(b, "epoll_worker_busy_seconds_total{worker=\"%d\"} %.6f\n", i,
+                      atomic_load_explicit(&server_workers[i].busy_ns, memory_order_relaxed) / 1e9);
+    }
+    metric_header(b, "epoll_worker_connections", "gauge", "Connections owned by the worker.");
+    for (i = 0; i < cfg.workers; i++) {
+        buffer_printf(b, "epoll_worker_connections{worker=\"%d\"} %d\n", i,
+                      atomic_load_explicit(&server_workers[i].load, memory_order_relaxed));
+    }
+
+    if (cfg.perf_counters) {
+        metrics_perf(b);
+    }
+
+    metric_header(b, "epoll_response_latency_seconds", "histogram",
+                  "From the wakeup that reported a connection to its responses being handed to the socket.");
+    for (k = 0; k < LATENCY_BUCKETS; k++) {
+        count += STAT_SUM(latency[k]);
+        if (k < LATENCY_BUCKETS - 1) {
+            buffer_printf(b, "epoll_response_latency_seconds_bucket{le=\"%g\"} %lu\n", latency_bounds[k] / 1e9, count);
+        } else {
+            buffer_printf(b, "epoll_response_latency_seconds_bucket{le=\"+Inf\"} %lu\n", count);
+        }
+    }
+    buffer_printf(b, "epoll_response_latency_seconds_sum %.9f\n", STAT_SUM(latency_sum) / 1e9);
+    buffer_printf(b, "epoll_response_latency_seconds_count %lu\n", count);
+}
+
+static int top_entry_cmp(const void *a, const void *b) {
+    const struct top_entry *x = a;
+    const struct top_entry *y = b;
+
+    return x->rate < y->rate ? 1 : x->rate > y->rate ? -1 : 0;
+}
+
+// The n busiest connections of all workers, from the lists published after their last window
+static void connections_write(struct buffer *b, int n) {
+    int i;
+    int k;
+    int total = 0;
+    unsigned seq;
+    uint64_t now = now_ns();
+    uint64_t start;
+    uint64_t end;
+    struct worker *w;
+    struct top_entry *all;
+    char addr[INET_ADDRSTRLEN];
+
+    if ((all = malloc(cfg.workers * TOP_CONNS * sizeof(*all))) == NULL) {
+        buffer_printf(b, "out of memory\n");
+        return;
+    }
+
+    for (i = 0; i < cfg.workers; i++) {
+        w = &server_workers[i];
+        do { // Retry while the worker is publishing
+            while ((seq = atomic_load_explicit(&w->top_seq, memory_order_acquire)) & 1) {
+            }
+            k = w->ntop_pub;
+            start = w->top_pub_start;
+            end = w->top_pub_end;
+            memcpy(&all[total], w->top_pub, k * sizeof(*all));
+            atomic_thread_fence(memory_order_acquire);
+        } while (atomic_load_explicit(&w->top_seq, memory_order_relaxed) != seq);
+
+        // A worker publishes when it wakes up, an old list means it has been idle since
+        if (now - end > 2 * (uint64_t)TOP_WINDOW_NS || end <= start) {
+            continue;
+        }
+        for (; k > 0; k--, total++) {
+            all[total].rate = all[total].win_msgs * 1e9 / (end - start);
+        }
+    }
+
+    qsort(all, total, sizeof(*all), top_entry_cmp);
+    buffer_printf(b, "%-6s %-6s %-21s %10s %12s %12s %12s %10s %8s\n",
+                  "worker", "fd", "peer", "req/s", "requests", "bytes_in", "bytes_out", "queued", "idle_ms");
+    for (i = 0; i < total && i < n; i++) {
+        inet_ntop(AF_INET, &all[i].peer_addr, addr, sizeof(addr));
+        buffer_printf(b, "%-6d %-6d %15s:%-5u %10.0f %12lu %12lu %12lu %10zu %8lu\n",
+                      all[i].worker, all[i].fd, addr, all[i].peer_port, all[i].rate,
+                      all[i].msgs, all[i].bytes_in, all[i].bytes_out, all[i].queued,
+                      now > all[i].last_active ? (now - all[i].last_active) / 1000000 : 0);
+    }
+    free(all);
+}
+
+static void admin_respond(struct worker *w, struct conn *c, const char *status, struct buffer *body) {
+    struct buffer head = { NULL, 0, 0, 0, 0 };
+
+    buffer_printf(&head, "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                  "Content-Length: %zu\r\nConnection: close\r\n\r\n", status, buffer_size(body));
+    conn_append(w, &c->out, head.data + head.off, buffer_size(&head));
+    conn_append(w, &c->out, body->data + body->off, buffer_size(body));
+    buffer_free(&head);
+}
+
+// Write the body of an admin path, shared by HTTP and the binary protocol; 0 if there is no such path
+static int admin_route(const char *path, struct buffer *body) {
+    if (strcmp(path, "/metrics") == 0) {
+        metrics_write(body);
+    } else if (strcmp(path, "/connections") == 0 || strncmp(path, "/connections?n=", 15) == 0) {
+        connections_write(body, path[12] == '?' ? atoi(path + 15) : 10);
+    } else if (strcmp(path, "/") == 0) {
+        buffer_printf(body, "/metrics\n/connections?n=10\n");
+    } else {
+        buffer_printf(body, "not found\n");
+        return 0;
+    }
+
+    return 1;
+}
+
+// Threads and queue of the async pool, shared by all workers (see struct async_job)
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        // Waits on CLOCK_MONOTONIC, the clock of `due`
+    struct async_job *queue;    // By due time, first in first out among equal ones
+    int stop;
+    pthread_t *threads;
+} async_pool;
+
+// Hand a request to the pool, h is NULL for an admin request over HTTP
+static void async_submit(struct worker *w, struct conn *c, const struct bin_header *h, const char *arg, size_t len,
+                         uint64_t delay_ns) {
+    struct async_job *job;
+    struct async_job **p;
+
+    if ((job = calloc(1, sizeof(*job))) == NULL) {
+        perror("[!] calloc()");
+        exit(EXIT_FAILURE);
+    }
+    job->w = w;
+    job->c = c;
+    job->http = h == NULL;
+    if (h != NULL) {
+        job->h = *h;
+    }
+    snprintf(job->path, sizeof(job->path), "%.*s", (int)len, arg);
+    job->due = now_ns() + delay_ns;
+
+    job->next_w = w->async_jobs;
+    if (job->next_w != NULL) {
+        job->next_w->prev_w = job;
+    }
+    w->async_jobs = job;
+    c->async++;
+    stat_add(&w->stats.async_started, 1);
+
+    pthread_mutex_lock(&async_pool.lock);
+    for (p = &async_pool.queue; *p != NULL && (*p)->due <= job->due; p = &(*p)->next) {
+    }
+    job->next = *p;
+    *p = job;
+    pthread_cond_signal(&async_pool.cond);
+    pthread_mutex_unlock(&async_pool.lock);
+}
+
+static void *async_run(void *arg) {
+    uint64_t one = 1;
+    struct timespec ts;
+    struct worker *w;
+    struct async_job *job;
+    struct async_job *head;
+
+    (void)arg;
+    pthread_mutex_lock(&async_pool.lock);
+    while (!async_pool.stop) {
+        // Sleep until the first job is due, a new first job wakes the pool up again
+        if ((job = async_pool.queue) == NULL) {
+            pthread_cond_wait(&async_pool.cond, &async_pool.lock);
+            continue;
+        } else if (job->due > now_ns()) {
+            ts.tv_sec = job->due / 1000000000ULL;
+            ts.tv_nsec = job->due % 1000000000ULL;
+            pthread_cond_timedwait(&async_pool.cond, &async_pool.lock, &ts);
+            continue;
+        }
+        async_pool.queue = job->next;
+        pthread_mutex_unlock(&async_pool.lock);
+
+        if (job->http || job->h.opcode == BIN_ADMIN) {
+            job->found = admin_route(job->path, &job->res);
+        }
+
+        // The worker may free the job as soon as it is pushed
+        w = job->w;
+        head = atomic_load_explicit(&w->async_done, memory_order_relaxed);
+        do {
+            job->next = head;
+        } while (!atomic_compare_exchange_weak_explicit(&w->async_done, &head, job, memory_order_release,
+                                                        memory_order_relaxed));
+        if (write(w->async_fd, &one, sizeof(one)) < 0) {
+            perror("[!] write(async_fd)");
+        }
+
+        pthread_mutex_lock(&async_pool.lock);
+    }
+    pthread_mutex_unlock(&async_pool.lock);
+
+    return NULL;
+}
+
+static void async_pool_start(void) {
+    int i;
+    pthread_condattr_t attr;
+
+    pthread_mutex_init(&async_pool.lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&async_pool.cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if ((async_pool.threads = calloc(cfg.async_threads, sizeof(*async_pool.threads))) == NULL) {
+        perror("[!] calloc()");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < cfg.async_threads; i++) {
+        if (pthread_create(&async_pool.threads[i], NULL, async_run, NULL) != 0) {
+            perror("[!] pthread_create()");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// After the workers are gone; every job still around is on its worker's list of unfinished ones
+static void async_pool_stop(struct worker *workers) {
+    int i;
+    struct async_job *job;
+
+    pthread_mutex_lock(&async_pool.lock);
+    async_pool.stop = 1;
+    pthread_cond_broadcast(&async_pool.cond);
+    pthread_mutex_unlock(&async_pool.lock);
+    for (i = 0; i < cfg.async_threads; i++) {
+        pthread_join(async_pool.threads[i], NULL);
+    }
+    free(async_pool.threads);
+
+    for (i = 0; i < cfg.workers; i++) {
+        while ((job = workers[i].async_jobs) != NULL) {
+            workers[i].async_jobs = job->next_w;
+            buffer_free(&job->res);
+            free(job);
+        }
+    }
+    pthread_cond_destroy(&async_pool.cond);
+    pthread_mutex_destroy(&async_pool.lock);
+}
+
+// One line of an admin request, the response is queued as soon as the request line is in
+static void admin_request(struct worker *w, struct conn *c, char *line, size_t len) {
+    char *path;
+    char *version;
+    struct buffer body = { NULL, 0, 0, 0, 0 };
+
+    if (len > 0 && line[len - 1] == '\r') {
+        line[--len] = '\0';
+    }
+
+    if (c->admin == ADMIN_HEADERS) {
+        if (len == 0) { // End of the request headers
+            c->admin = ADMIN_DONE;
+        }
+        return;
+    } else if (c->admin != ADMIN_REQUEST) {
+        return;
+    }
+
+    // "GET /path HTTP/1.1", a request without a version has no headers
+    path = strchr(line, ' ');
+    version = path != NULL ? strchr(path + 1, ' ') : NULL;
+    if (version != NULL) {
+        *version = '\0';
+    }
+    c->admin = version != NULL ? ADMIN_HEADERS : ADMIN_DONE;
+
+    if (strncmp(line, "GET ", 4) != 0 || path == NULL) {
+        buffer_printf(&body, "only GET is supported\n");
+        admin_respond(w, c, "405 Method Not Allowed", &body);
+    } else if (cfg.async_threads > 0) { // Answered by worker_async()
+        async_submit(w, c, NULL, path + 1, strlen(path + 1), 0);
+    } else {
+        admin_respond(w, c, admin_route(path + 1, &body) ? "200 OK" : "404 Not Found", &body);
+    }
+    buffer_free(&body);
+}
+
+// Answer of %date% and %time%
+static size_t clock_reply(char *reply, size_t size, const char *fmt) {
+    time_t t = time(NULL);
+    struct tm tm;
+
+    localtime_r(&t, &tm);
+    return strftime(reply, size, fmt, &tm);
+}
+
+// Run a single request and queue its response
+static void conn_handle_msg(struct worker *w, struct conn *c, char *msg, size_t len, char term) {
+    char reply[MAX_LINE];
+    const char *res = msg;
+    size_t res_len = len;
+    int cmd = CMD_ECHO;
+
+    msg[len] = '\0'; // Terminate the request in place so it can be compared as a string
+    c->activity++;
+    c->msgs++;
+    TRACE(w, TRACE_DISPATCH_BEGIN, c->fd, 0);
+
+    if (c->admin) {
+        stat_add(&w->stats.commands[CMD_ADMIN], 1);
+        admin_request(w, c, msg, len);
+        TRACE(w, TRACE_DISPATCH_END, c->fd, CMD_ADMIN);
+        return;
+    }
+
+    /* Echo function */
+    if (strcmp(msg, "%date%") == 0) { // Check if the input is "%%date%%"
+        res_len = clock_reply(reply, sizeof(reply), "%x");
+        res = reply;
+        cmd = CMD_DATE;
+    } else if (strcmp(msg, "%time%") == 0) { // Check if the input is "%%time%%"
+        res_len = clock_reply(reply, sizeof(reply), "%X");
+        res = reply;
+        cmd = CMD_TIME;
+    }
+    stat_add(&w->stats.commands[cmd], 1);
+    TRACE(w, TRACE_DISPATCH_END, c->fd, cmd);
+
+    if (verbose) {
+        printf("[+] data (%zu bytes): %s -> %.*s\n", len + 1, msg, (int)res_len, res);
+    }
+
+    // Queue the response followed by the terminator of the request
+    conn_append(w, &c->out, res, res_len);
+    conn_append(w, &c->out, &term, 1);
+}
+
+// Run a request of the binary protocol and queue its response
+static void conn_handle_frame(struct worker *w, struct conn *c, const struct bin_header *req, const char *payload,
+                              size_t len) {
+    char reply[MAX_LINE];
+    char path[MAX_LINE];
+    struct bin_header h = *req;
+    struct buffer body = { NULL, 0, 0, 0, 0 };
+    const char *res = reply;
+    size_t res_len = 0;
+    int cmd = CMD_ECHO;
+    int async = 0;
+    uint32_t ms = 0;
+
+    c->activity++;
+    c->msgs++;
+    TRACE(w, TRACE_DISPATCH_BEGIN, c->fd, 0);
+
+    h.status = htons(BIN_OK);
+    switch (req->opcode) {
+        case BIN_ECHO:
+            res = payload;
+            res_len = len;
+            break;
+        case BIN_DATE:
+            res_len = clock_reply(reply, sizeof(reply), "%x");
+            cmd = CMD_DATE;
+            break;
+        case BIN_TIME:
+            res_len = clock_reply(reply, sizeof(reply), "%X");
+            cmd = CMD_TIME;
+            break;
+        case BIN_ADMIN:
+            cmd = CMD_ADMIN;
+            if (cfg.async_threads > 0) {
+                async = 1;
+                break;
+            }
+            snprintf(path, sizeof(path), "%.*s", (int)len, payload);
+            if (!admin_route(path, &body)) {
+                h.status = htons(BIN_ENOTFOUND);
+            }
+            res = body.data + body.off;
+            res_len = buffer_size(&body);
+            break;
+        case BIN_SLEEP:
+            cmd = CMD_SLEEP;
+            if (len == sizeof(ms)) {
+                memcpy(&ms, payload, sizeof(ms));
+                ms = ntohl(ms);
+            }
+            if (cfg.async_threads == 0) { // Would stall the event loop
+                h.status = htons(BIN_EOPCODE);
+            } else if (len != sizeof(ms) || ms > ASYNC_MAX_SLEEP_MS) {
+                h.status = htons(BIN_EINVAL);
+            } else {
+                async = 1;
+            }
+            break;
+        default:
+            h.status = htons(BIN_EOPCODE);
+            break;
+    }
+    if (async && c->async == UINT8_MAX) {
+        h.status = htons(BIN_EBUSY);
+        async = 0;
+    }
+    stat_add(&w->stats.commands[cmd], 1);
+    TRACE(w, TRACE_DISPATCH_END, c->fd, cmd);
+
+    if (async) { // Answered by worker_async()
+        async_submit(w, c, req, payload, len, (uint64_t)ms * 1000000ULL);
+        if (verbose) {
+            printf("[+] frame %u, opcode %u (%zu bytes) -> async\n", ntohl(req->id), req->opcode, len);
+        }
+        return;
+    }
+
+    if (verbose) {
+        printf("[+] frame %u, opcode %u (%zu bytes) -> status %u, %zu bytes\n", ntohl(req->id), req->opcode,
+               len, ntohs(h.status), res_len);
+    }
+
+    h.length = htonl(res_len);
+    conn_append(w, &c->out, (const char *)&h, sizeof(h));
+    conn_append(w, &c->out, res, res_len);
+    buffer_free(&body);
+}
+
+// Handle the complete frames at data, return the bytes they take or -1 for a malformed one
+static ssize_t conn_frames(struct worker *w, struct conn *c, const char *data, size_t n) {
+    size_t len;
+    size_t used = 0;
+    struct bin_header h;
+
+    while (used < n) {
+        // A stray byte is rejected right away, not once a whole header has arrived
+        if ((uint8_t)data[used] != BIN_MAGIC) {
+            if (verbose) {
+                printf("[!] malformed frame (magic 0x%02x)\n", (uint8_t)data[used]);
+            }
+            return -1;
+        }
+        if (n - used < sizeof(h)) {
+            break;
+        }
+
+        memcpy(&h, data + used, sizeof(h)); // The header may not be aligned
+        len = ntohl(h.length);
+        if (len > (size_t)cfg.max_msg) {
+            if (verbose) {
+                printf("[!] oversized frame (%zu bytes)\n", len);
+            }
+            return -1;
+        }
+        if (n - used - sizeof(h) < len) {
+            break;
+        }
+
+        conn_handle_frame(w, c, &h, data + used + sizeof(h), len);
+        used += sizeof(h) + len;
+    }
+
+    return used;
+}
+
+// Handle the complete text requests at data, return the bytes they take
+static size_t conn_lines(struct worker *w, struct conn *c, char *data, size_t n) {
+    char *p;
+    char *msg = data;
+
+    for (p = data; p < data + n; p++) {
+        if (*p == '\0' || *p == '\n') {
+            conn_handle_msg(w, c, msg, p - msg, *p);
+            msg = p + 1;
+        }
+    }
+
+    return msg - data;
+}
+
+// The first byte of a connection decides its protocol
+static void conn_detect(struct conn *c, const char *data) {
+    if (c->proto == PROTO_NONE) {
+        c->proto = (uint8_t)data[0] == BIN_MAGIC ? PROTO_BINARY : PROTO_TEXT;
+    }
+}
+
+// Handle every complete request in the input, -1 if the connection has to be dropped
+static int conn_parse(struct worker *w, struct conn *c) {
+    char *end;
+    char term;
+    ssize_t used;
+
+    if (buffer_size(&c->in) > 0) {
+        conn_detect(c, c->in.data + c->in.off);
+    }
+
+    if (c->proto == PROTO_BINARY) {
+        if ((used = conn_frames(w, c, c->in.data + c->in.off, buffer_size(&c->in))) < 0) {
+            return -1;
+        }
+        buffer_consume(&c->in, used);
+        if (buffer_size(&c->in) == 0) {
+            conn_release(w, &c->in);
+        }
+        return 0;
+    }
+
+    while ((end = buffer_find_msg(&c->in, c->scanned)) != NULL) {
+        term = *end;
+        conn_handle_msg(w, c, c->in.data + c->in.off, end - (c->in.data + c->in.off), term);
+        buffer_consume(&c->in, end - (c->in.data + c->in.off) + 1);
+        c->scanned = 0;
+    }
+    c->scanned = buffer_size(&c->in);
+
+    if (buffer_size(&c->in) > (size_t)cfg.max_msg) { // Refuse requests that never terminate
+        if (verbose) {
+            printf("[!] request exceeds %d bytes\n", cfg.max_msg);
+        }
+        return -1;
+    }
+
+    // Nothing left over, the connection is idle again
+    if (c->scanned == 0) {
+        conn_release(w, &c->in);
+    }
+
+    return 0;
+}
+
+/*
+ * Handle received data that is still in a worker buffer. While no partial request is
+ * pending, the requests are parsed in place and only a trailing partial one is copied
+ * to the connection, which is the only time it needs an input buffer.
+ */
+static int conn_input(struct worker *w, struct conn *c, char *data, size_t n) {
+    ssize_t used;
+
+    conn_detect(c, data);
+    if (buffer_size(&c->in) == 0) {
+        used = c->proto == PROTO_BINARY ? conn_frames(w, c, data, n) : (ssize_t)conn_lines(w, c, data, n);
+        if (used < 0) {
+            return -1;
+        }
+        if ((size_t)used == n) {
+            return 0;
+        }
+        data += used;
+        n -= used;
+    }
+
+    conn_append(w, &c->in, data, n);
+    return conn_parse(w, c);
+}
+
+// Send the pending responses, through the reactor if it does the I/O
+static int conn_flush(struct worker *w, struct conn *c) {
+    int ret;
+    size_t pending = buffer_size(&c->out);
+
+    if (reactor->send != NULL) {
+        return reactor->send(w, c); // Counted when the send completes
+    }
+
+    TRACE(w, TRACE_WRITE_BEGIN, c->fd, pending);
+    ret = buffer_flush(&c->out, c->fd);
+    TRACE(w, TRACE_WRITE_END, c->fd, buffer_size(&c->out));
+    stat_add(&w->stats.bytes_out, pending - buffer_size(&c->out));
+    c->bytes_out += pending - buffer_size(&c->out);
+    if (buffer_size(&c->out) == 0) {
+        conn_release(w, &c->out);
+    }
+    return ret;
+}
+
+static int conn_read(struct worker *w, struct conn *c) {
+    int n;
+    int ret;
+    char *dst;
+    size_t len;
+
+    for (;;) {
+        // A partial request in a ring is completed in place, everything else is read into the scratch buffer
+        dst = w->rbuf;
+        len = cfg.read_size;
+        if (c->in.kind == BUFFER_RING && buffer_size(&c->in) < c->in.cap) {
+            dst = c->in.data + c->in.len;
+            len = c->in.cap - buffer_size(&c->in) < len ? c->in.cap - buffer_size(&c->in) : len;
+        }
+
+        // Read the data from the client socket to the buffer
+        TRACE(w, TRACE_READ_BEGIN, c->fd, 0);
+        n = read(c->fd, dst, len);
+        TRACE(w, TRACE_READ_END, c->fd, n > 0 ? n : 0);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break; // Drained the socket (edge-triggered mode)
+            } else if (errno == EINTR) {
+                continue;
+            }
+
+            perror("[!] read()");
+            return -1;
+        } else if (n == 0) { // The peer closed the connection, hand over what is already answered
+            conn_flush(w, c);
+            return -1;
+        }
+
+        stat_add(&w->stats.bytes_in, n);
+        c->bytes_in += n;
+
+        // The kernel clears TCP_QUICKACK after it has been used, so it has to be re-armed
+        if (cfg.quickack) {
+            setsockopt(c->fd, IPPROTO_TCP, TCP_QUICKACK, &cfg.quickack, sizeof(cfg.quickack));
+        }
+
+        if (dst == w->rbuf) {
+            ret = conn_input(w, c, dst, n);
+        } else {
+            c->in.len += n;
+            ret = conn_parse(w, c);
+        }
+        if (ret < 0) { // A protocol error, the requests before it still get their responses
+            conn_flush(w, c);
+            return -1;
+        }
+    }
+
+    return conn_flush(w, c);
+}
+
+// The reactor already received the data into the input (completion-based backends)
+static int conn_received(struct worker *w, struct conn *c) {
+    if (conn_parse(w, c) < 0) {
+        conn_flush(w, c);
+        return -1;
+    }
+
+    return conn_flush(w, c);
+}
+
+// Set by SIGINT/SIGTERM or "exit", the workers then shut down through the normal exit path
+static volatile sig_atomic_t stop_requested = 0;
+
+// Readable once a stop is requested; registered (level-triggered) in every worker's epoll instance
+static int stop_fd = -1;
+
+static void server_stop(void) {
+    uint64_t one = 1;
+
+    stop_requested = 1;
+    if (write(stop_fd, &one, sizeof(one)) < 0) { // async-signal-safe
+        stop_requested = 1;
+    }
+}
+
+static void on_stop_signal(int sig) {
+    (void)sig;
+    server_stop();
+}
+
+// Apply the configured socket options to a listener, a failure only costs the optimization
+static void tune_listener(int fd) {
+    if (cfg.rcvbuf > 0 && setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &cfg.rcvbuf, sizeof(cfg.rcvbuf)) < 0) {
+        perror("[!] SO_RCVBUF");
+    }
+    if (cfg.sndbuf > 0 && setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &cfg.sndbuf, sizeof(cfg.sndbuf)) < 0) {
+        perror("[!] SO_SNDBUF");
+    }
+    if (cfg.defer_accept > 0 &&
+        setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &cfg.defer_accept, sizeof(cfg.defer_accept)) < 0) {
+        perror("[!] TCP_DEFER_ACCEPT");
+    }
+    if (cfg.fastopen > 0 && setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &cfg.fastopen, sizeof(cfg.fastopen)) < 0) {
+        perror("[!] TCP_FASTOPEN");
+    }
+}
+
+// Apply the configured socket options to an accepted connection
+static void tune_conn_socket(int fd) {
+    if (cfg.nodelay) {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &cfg.nodelay, sizeof(cfg.nodelay));
+    }
+    if (cfg.quickack) {
+        setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &cfg.quickack, sizeof(cfg.quickack));
+    }
+    if (cfg.rcvlowat > 0) {
+        setsockopt(fd, SOL_SOCKET, SO_RCVLOWAT, &cfg.rcvlowat, sizeof(cfg.rcvlowat));
+    }
+}
+
+// Listener of the admin endpoint, on the server's address
+static int create_admin_listener(void) {
+    int sock;
+    int one = 1;
+    struct sockaddr_in addr;
+
+    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        perror("[!] Cannot create the admin socket");
+        exit(EXIT_FAILURE);
+    }
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    set_sockaddr(&addr);
+    addr.sin_port = htons(cfg.admin_port);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("[!] Cannot bind the admin socket");
+        exit(EXIT_FAILURE);
+    }
+    if (setnonblocking(sock) < 0 || listen(sock, 16) < 0) {
+        perror("[!] Cannot listen on the admin socket");
+        exit(EXIT_FAILURE);
+    }
+
+    return sock;
+}
+
+static int create_listener(int cpu) {
+    int listen_sock;
+    int one = 1;
+    struct sockaddr_in srv_addr;
+
+    // Create a socket using TCP protocol in IPv4 domain & get the file descriptor
+    if((listen_sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        perror("[!] Cannot create socket file descriptor\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Connections the server closed itself (protocol errors) linger in TIME_WAIT, a restart may still bind
+    setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    // Let every worker bind its own listener to the same address, the kernel balances between them
+    if (cfg.accept_mode == ACCEPT_REUSEPORT && cfg.workers > 1 && setsockopt(listen_sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        perror("[!] Cannot set SO_REUSEPORT\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Buffer sizes must be set before listen() to affect the window scale of accepted connections
+    tune_listener(listen_sock);
+
+    // Prefer this listener for connections whose packets are processed on the worker's CPU (Linux 6.2+
+    // honours it within a SO_REUSEPORT group), so softirq, accept and the event loop share one cache
+    if (cpu >= 0 && cfg.incoming_cpu && cfg.accept_mode == ACCEPT_REUSEPORT && cfg.workers > 1 &&
+        setsockopt(listen_sock, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) < 0) {
+        perror("[!] SO_INCOMING_CPU");
+    }
+
+    // Set the socket address & port information for the server
+    set_sockaddr(&srv_addr);
+
+    // Give the socket fd the local address with the size of the info struct
+    if(bind(listen_sock, (struct sockaddr *)&srv_addr, sizeof(srv_addr)) < 0) {
+        perror("[!] Cannot bind the socket\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Set the file descriptor to non-blocking mode because of using epoll edge-triggered mode
+    if(setnonblocking(listen_sock) < 0) {
+        perror("[!] Cannot set the socket to non-blocking mode\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Set the socket to listen mode with the configured backlog
+    if(listen(listen_sock, cfg.backlog) < 0) {
+        perror("[!] Cannot listen on the socket\n");
+        exit(EXIT_FAILURE);
+    }
+
+    return listen_sock;
+}
+
+// Accept the next pending connection and set it up, -1 once the accept queue is empty
+static int accept_conn(int listen_sock) {
+    int conn_sock;
+    socklen_t socklen;
+    char addr_buf[INET_ADDRSTRLEN];
+    struct sockaddr_in cli_addr;
+
+    for (;;) {
+        // Accept the incoming connection and get the file descriptor of the new client socket fd
+        socklen = sizeof(cli_addr);
+        if ((conn_sock = accept(listen_sock, (struct sockaddr *)&cli_addr, &socklen)) < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            return -1;
+        }
+
+        if (conn_sock >= conns_cap) { // Cannot happen while RLIMIT_NOFILE is unchanged
+            close(conn_sock);
+            continue;
+        }
+
+        // Convert the IP address from binary to text
+        if (verbose) {
+            inet_ntop(AF_INET, (char *)&(cli_addr.sin_addr), addr_buf, sizeof(addr_buf));
+            printf("[+] connected with %s:%d\n", addr_buf, ntohs(cli_addr.sin_port));
+        }
+
+        setnonblocking(conn_sock); // Set the client socket to non-blocking mode
+        tune_conn_socket(conn_sock);
+        return conn_sock;
+    }
+}
+
+// Events a connection waits for
+// EPOLLOUT: Resume flushing responses once the kernel buffer has room again
+// EPOLLRDHUP: Stream socket peer closed connection, or shut down writing half of connection
+// EPOLLHUP: Hang up happened on the associated file descriptor
+static uint32_t conn_events(const struct conn *c) {
+    return EPOLLIN | EPOLLET | EPOLLRDHUP | EPOLLHUP | (reactor->edge || c->want_out ? EPOLLOUT : 0);
+}
+
+// Level-triggered reactors only wait for EPOLLOUT while responses are pending, or every wait would report it
+static void conn_watch(struct worker *w, struct conn *c) {
+    int want = buffer_size(&c->out) > 0;
+
+    if (!reactor->edge && want != c->want_out) {
+        c->want_out = want;
+        reactor->mod(w, c->fd, conn_events(c));
+    }
+}
+
+// Start serving an accepted or migrated connection on this worker (its load is already counted)
+static void worker_adopt(struct worker *w, int fd) {
+    struct conn *c = conns[fd];
+
+    // New connections are allocated by the worker itself, so the state is local to its CPU
+    if (c == NULL) {
+        c = conn_new(fd);
+        stat_add(&w->stats.accepted, 1);
+        TRACE(w, TRACE_ACCEPT, fd, 0);
+    }
+    conn_link(w, c);
+
+    // Add the client socket to the events queue, which also reports data that arrived during a migration
+    c->want_out = buffer_size(&c->out) > 0;
+    reactor_add(w, fd, conn_events(c));
+}
+
+static void worker_accept(struct worker *w) {
+    int conn_sock;
+    int n = 0;
+    int max = cfg.accept_mode == ACCEPT_EXCLUSIVE ? EXCLUSIVE_ACCEPTS : INT_MAX;
+
+    /* handle new connection */
+    // Edge-triggered mode only reports the listen socket once, so drain the whole accept queue.
+    // The shared listener of exclusive mode is level-triggered: leaving connections in the queue
+    // lets the other workers' wakeups pick them up instead of one worker taking a whole burst
+    while (n++ < max && (conn_sock = accept_conn(w->listen_sock)) >= 0) {
+        atomic_fetch_add_explicit(&w->load, 1, memory_order_relaxed);
+        worker_adopt(w, conn_sock);
+    }
+}
+
+// Connections to the admin endpoint are served like clients, but answer admin requests
+static void admin_accept(struct worker *w) {
+    int fd;
+    struct conn *c;
+
+    while ((fd = accept_conn(w->admin_sock)) >= 0) {
+        atomic_fetch_add_explicit(&w->load, 1, memory_order_relaxed);
+        c = conn_new(fd);
+        c->admin = ADMIN_REQUEST;
+        c->proto = PROTO_TEXT;
+        conn_link(w, c);
+        reactor_add(w, fd, conn_events(c));
+    }
+}
+
+/*
+ * Move connections to the worker chosen by the rebalancer. Only the owner touches
+ * its connections: it removes them from its reactor and hands them over through
+ * the target's inbox, where they are added to the target's reactor.
+ * Connections are picked until they carry the requested share of the requests
+ * this worker handled recently; idle ones are left alone.
+ */
+static void worker_migrate(struct worker *w, struct worker *to) {
+    int n = 0;
+    uint64_t one = 1;
+    unsigned long total = 0;
+    unsigned long goal;
+    unsigned long moved = 0;
+    unsigned activity;
+    struct conn *c;
+    struct conn *next;
+
+    for (c = w->conn_list; c != NULL; c = c->next) {
+        total += c->activity;
+    }
+    goal = total * atomic_load_explicit(&w->steal_permille, memory_order_relaxed) / 1000;
+
+    for (c = w->conn_list; c != NULL; c = next) {
+        next = c->next;
+        activity = c->activity;
+        c->activity = 0; // Start a new measurement window
+
+        // Results from the async pool come back to this worker, so those connections stay
+        if (activity > 0 && c->async == 0 && moved + activity <= goal) {
+            // Detach the connection completely first: once it is pushed, the target may adopt
+            // it at any moment, and c must not be touched here any more
+            reactor->del(w, c->fd);
+            conn_unlink(w, c);
+            if (fd_queue_push(&to->inbox, c->fd) < 0) { // The target is full, keep this one and the rest here
+                conn_link(w, c);
+                reactor_add(w, c->fd, conn_events(c));
+                goal = moved;
+                continue;
+            }
+
+            moved += activity;
+            n++;
+        }
+    }
+
+    if (n > 0) {
+        atomic_fetch_sub_explicit(&w->load, n, memory_order_relaxed);
+        atomic_fetch_add_explicit(&to->load, n, memory_order_relaxed);
+        if (write(to->wake_fd, &one, sizeof(one)) < 0) {
+            perror("[!] write(wake_fd)");
+        }
+    }
+
+    if (verbose) {
+        printf("[+] worker %d moved %d connection(s) (%lu of %lu requests) to worker %d\n",
+               w->id, n, moved, total, to->id);
+    }
+}
+
+// Register the connections handed over by the acceptor or another worker
+static void worker_inbox(struct worker *w) {
+    int fd;
+    uint64_t n;
+
+    // Reset the eventfd before draining, so a push that races with the drain signals again
+    if (read(w->wake_fd, &n, sizeof(n)) < 0 && errno != EAGAIN) {
+        perror("[!] read(wake_fd)");
+    }
+
+    while ((fd = fd_queue_pop(&w->inbox)) >= 0) {
+        worker_adopt(w, fd);
+    }
+}
+
+// Answer the requests the async pool has finished
+static void worker_async(struct worker *w) {
+    uint64_t n;
+    struct conn *c;
+    struct async_job *job;
+    struct async_job *next;
+    struct async_job *done = NULL;
+
+    // Reset the eventfd before taking the jobs, so a push that races with it signals again
+    if (read(w->async_fd, &n, sizeof(n)) < 0 && errno != EAGAIN) {
+        perror("[!] read(async_fd)");
+    }
+
+    // The stack is newest first, answer in the order the jobs finished
+    for (job = atomic_exchange_explicit(&w->async_done, NULL, memory_order_acquire); job != NULL; job = next) {
+        next = job->next;
+        job->next = done;
+        done = job;
+    }
+
+    for (job = done; job != NULL; job = next) {
+        next = job->next;
+        if (job->prev_w != NULL) {
+            job->prev_w->next_w = job->next_w;
+        } else {
+            w->async_jobs = job->next_w;
+        }
+        if (job->next_w != NULL) {
+            job->next_w->prev_w = job->prev_w;
+        }
+        stat_add(&w->stats.async_finished, 1);
+
+        if ((c = job->c) != NULL) {
+            c->async--;
+            if (job->http) {
+                admin_respond(w, c, job->found ? "200 OK" : "404 Not Found", &job->res);
+            } else {
+                job->h.status = htons(job->h.opcode == BIN_ADMIN && !job->found ? BIN_ENOTFOUND : BIN_OK);
+                job->h.length = htonl(buffer_size(&job->res));
+                conn_append(w, &c->out, (const char *)&job->h, sizeof(job->h));
+                if (buffer_size(&job->res) > 0) { // A sleep has no result at all
+                    conn_append(w, &c->out, job->res.data + job->res.off, buffer_size(&job->res));
+                }
+            }
+            if (verbose) {
+                printf("[+] async %s finished, %zu bytes\n", job->http ? job->path : cmd_names[job->h.opcode == BIN_ADMIN ?
+                       CMD_ADMIN : CMD_SLEEP], buffer_size(&job->res));
+            }
+
+            if (conn_flush(w, c) < 0 || (c->admin == ADMIN_DONE && c->async == 0 && buffer_size(&c->out) == 0)) {
+                conn_close(w, c);
+            } else {
+                conn_watch(w, c);
+            }
+        }
+        buffer_free(&job->res);
+        free(job);
+    }
+}
+
+static void worker_stdin(struct worker *w) {
+    int n;
+    char buf[MAX_LINE];
+
+    /* handle stdin */
+    for (;;) {
+        bzero(buf, sizeof(buf)); // Set the buffer to 0s
+
+        // Read the data from the stdin to the buffer
+        // EAGAIN: Try read again because of resource is temporarily unavailable (non-blocking mode)
+        if ((n = read(STDIN_FILENO, buf, sizeof(buf) - 1)) <= 0 /* || errno == EAGAIN */ ) {
+            if (n == 0) { // End of input, which a level-triggered reactor would keep reporting
+                reactor->del(w, STDIN_FILENO);
+            }
+            break;
+        } else {
+            if(strcmp(buf, "exit\n") == 0) { // Check if the input is "exit"
+                server_stop();
+            } else {
+                printf("[+] stdin (%d bytes): %s\n", n, buf);
+            }
+        }
+    }
+}
+
+// shared_sock is the listener of the exclusive accept mode, -1 otherwise
+static void worker_init(struct worker *w, int id, int shared_sock) {
+    w->id = id;
+    w->cpu = cpu_count > 0 ? cpu_list[id % cpu_count] : -1;
+    w->listen_sock = -1;
+    w->admin_sock = -1;
+    atomic_init(&w->load, 0);
+    atomic_init(&w->busy_ns, 0);
+    atomic_init(&w->steal_to, NULL);
+    atomic_init(&w->steal_permille, 0);
+    w->conn_list = NULL;
+
+    reactor->init(w);
+
+    // The acceptor, another worker or the rebalancer push to the inbox and then signal wake_fd
+    if ((w->wake_fd = eventfd(0, EFD_NONBLOCK)) == -1) {
+        perror("[!] eventfd()");
+        exit(EXIT_FAILURE);
+    }
+    fd_queue_init(&w->inbox, cfg.inbox);
+    reactor_add(w, w->wake_fd, EPOLLIN);
+
+    // Signalled by the async pool once it has finished jobs of this worker
+    if ((w->async_fd = eventfd(0, EFD_NONBLOCK)) == -1) {
+        perror("[!] eventfd()");
+        exit(EXIT_FAILURE);
+    }
+    atomic_init(&w->async_done, NULL);
+    w->async_jobs = NULL;
+    reactor_add(w, w->async_fd, EPOLLIN);
+
+    if (cfg.accept_mode == ACCEPT_REUSEPORT) {
+        w->listen_sock = create_listener(w->cpu);
+
+        // Add the listen socket to the events queue in epoll file descriptor
+        // EPOLLIN: The associated file is available for read(2) operations
+        // EPOLLOUT: The associated file is available for write(2) operations
+        // EPOLLET: Sets the Edge Triggered behavior for the associated file descriptor
+        reactor_add(w, w->listen_sock, EPOLLIN | EPOLLOUT | EPOLLET);
+    } else if (cfg.accept_mode == ACCEPT_EXCLUSIVE) {
+        w->listen_sock = shared_sock;
+
+        // EPOLLEXCLUSIVE: A new connection wakes one of the waiting workers instead of all of them
+        // Level-triggered, so a connection the woken worker leaves in the queue wakes the next one
+        reactor_add(w, w->listen_sock, EPOLLIN | EPOLLEXCLUSIVE);
+    }
+
+    // Level-triggered, so every worker keeps seeing the stop request
+    reactor_add(w, stop_fd, EPOLLIN);
+
+    if (id == 0 && cfg.admin_port > 0) {
+        w->admin_sock = create_admin_listener();
+        reactor_add(w, w->admin_sock, EPOLLIN | EPOLLET);
+    }
+
+    // Add stdin to the events queue of the first worker only
+    // Regular files and /dev/null cannot be polled (EPERM), the server then simply runs without a console
+    if (id == 0 && reactor->add(w, STDIN_FILENO, EPOLLIN | EPOLLET) < 0 && errno != EPERM) {
+        perror("epoll_ctl()\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Open the counter group for the calling worker thread. Kernel code is counted too
+ * unless perf_event_paranoid forbids it. The counters are read with rdpmc when the
+ * kernel allows it (cap_user_rdpmc), otherwise with one read() of the whole group.
+ */
+static struct perf_group *perf_open(struct worker *w) {
+    size_t i;
+    int exclude_kernel = 0;
+    struct perf_group *g;
+    struct perf_event_attr attr;
+
+    if ((g = calloc(1, sizeof(*g))) == NULL) {
+        perror("[!] calloc()");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < PERF_COUNTERS; i++) {
+        bzero(&attr, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = perf_counter_defs[i].type;
+        attr.config = perf_counter_defs[i].config;
+        attr.disabled = i == 0; // The group starts when its leader is enabled
+        attr.exclude_kernel = exclude_kernel;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+
+        g->fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, i == 0 ? -1 : g->fds[0], 0);
+        if (g->fds[i] < 0 && i == 0 && (errno == EACCES || errno == EPERM) && !exclude_kernel) {
+            exclude_kernel = 1; // User space only, as perf_event_paranoid 2 allows
+            i--;
+            continue;
+        }
+        if (g->fds[i] < 0) {
+            fprintf(stderr, "[!] worker %d: %s counter unavailable (%s), perf-counters off\n",
+                    w->id, perf_counter_defs[i].name, strerror(errno));
+            while (i-- > 0) {
+                close(g->fds[i]);
+            }
+            free(g);
+            return NULL;
+        }
+    }
+
+    g->rdpmc = 1;
+    for (i = 0; i < PERF_COUNTERS; i++) {
+        g->pages[i] = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, g->fds[i], 0);
+        if (g->pages[i] == MAP_FAILED) {
+            g->pages[i] = NULL;
+            g->rdpmc = 0;
+        }
+    }
+
+    ioctl(g->fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    for (i = 0; i < PERF_COUNTERS && g->rdpmc; i++) {
+        g->rdpmc = g->pages[i]->cap_user_rdpmc;
+    }
+#if !defined(__x86_64__) && !defined(__i386__)
+    g->rdpmc = 0;
+#endif
+
+    if (verbose) {
+        printf("[+] worker %d: hardware counters%s, read with %s\n", w->id,
+               exclude_kernel ? " (user space only)" : "", g->rdpmc ? "rdpmc" : "read()");
+    }
+    return g;
+}
+
+// Current count of one event from its mmap page, retried while the kernel updates the page
+static uint64_t perf_rdpmc(struct perf_event_mmap_page *pc) {
+    uint32_t seq;
+    uint32_t idx;
+    uint64_t count;
+    int64_t pmc = 0;
+
+    do {
+        seq = pc->lock;
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+        idx = pc->index;
+        count = pc->offset;
+#if defined(__x86_64__) || defined(__i386__)
+        if (idx != 0) { // 0: not currently on the PMU, the offset is the whole count
+            pmc = __builtin_ia32_rdpmc(idx - 1);
+            pmc = (int64_t)((uint64_t)pmc << (64 - pc->pmc_width)) >> (64 - pc->pmc_width);
+        }
+#endif
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    } while (pc->lock != seq);
+
+    return count + pmc;
+}
+
+static void perf_read(struct perf_group *g, uint64_t *vals) {
+    size_t i;
+    uint64_t buf[1 + PERF_COUNTERS];
+
+    if (g->rdpmc) {
+        for (i = 0; i < PERF_COUNTERS; i++) {
+            vals[i] = perf_rdpmc(g->pages[i]);
+        }
+    } else if (read(g->fds[0], buf, sizeof(buf)) == (ssize_t)sizeof(buf)) { // nr, then the values
+        memcpy(vals, buf + 1, PERF_COUNTERS * sizeof(*vals));
+    }
+}
+
+static void perf_begin(struct worker *w) {
+    size_t k;
+    struct perf_group *g = w->perf;
+
+    for (k = 0; k < CMD_COUNT; k++) {
+        g->begin_cmds[k] = atomic_load_explicit(&w->stats.commands[k], memory_order_relaxed);
+    }
+    perf_read(g, g->begin);
+}
+
+// Split the counts of the event over the requests it handled
+static void perf_end(struct worker *w) {
+    size_t i;
+    size_t k;
+    uint64_t n[CMD_COUNT];
+    uint64_t total = 0;
+    uint64_t vals[PERF_COUNTERS];
+    struct perf_group *g = w->perf;
+
+    perf_read(g, vals);
+    for (k = 0; k < CMD_COUNT; k++) {
+        n[k] = atomic_load_explicit(&w->stats.commands[k], memory_order_relaxed) - g->begin_cmds[k];
+        total += n[k];
+    }
+    if (total == 0) {
+        return; // Only flushed or closed
+    }
+
+    for (k = 0; k < CMD_COUNT; k++) {
+        if (n[k] == 0) {
+            continue;
+        }
+        stat_add(&g->requests[k], n[k]);
+        for (i = 0; i < PERF_COUNTERS; i++) {
+            stat_add(&g->counts[k][i], (vals[i] - g->begin[i]) * n[k] / total);
+        }
+    }
+}
+
+// Counts per request type over all workers, at shutdown
+static void perf_report(struct worker *workers) {
+    int w;
+    size_t i;
+    size_t k;
+    uint64_t req;
+    uint64_t sum[PERF_COUNTERS];
+
+    for (k = 0; k < CMD_COUNT; k++) {
+        req = 0;
+        bzero(sum, sizeof(sum));
+        for (w = 0; w < cfg.workers; w++) {
+            if (workers[w].perf == NULL) {
+                continue;
+            }
+            req += workers[w].perf->requests[k];
+            for (i = 0; i < PERF_COUNTERS; i++) {
+                sum[i] += workers[w].perf->counts[k][i];
+            }
+        }
+        if (req == 0) {
+            continue;
+        }
+
+        printf("[+] perf %s: %lu requests, IPC %.2f, per request %.0f cycles, %.0f instructions, "
+               "%.3f cache misses, %.3f branch misses, %.3f dTLB misses\n", cmd_names[k], req,
+               sum[0] ? (double)sum[1] / sum[0] : 0.0, (double)sum[0] / req, (double)sum[1] / req,
+               (double)sum[2] / req, (double)sum[3] / req, (double)sum[4] / req);
+    }
+}
+
+static void perf_close(struct perf_group *g) {
+    size_t i;
+
+    for (i = 0; i < PERF_COUNTERS; i++) {
+        if (g->pages[i] != NULL) {
+            munmap(g->pages[i], sysconf(_SC_PAGESIZE));
+        }
+        close(g->fds[i]);
+    }
+    free(g);
+}
+
+#ifdef EPOLL_TRACE
+// Map the worker's trace file, <trace_path>.<worker>
+static struct trace_ring *trace_open(struct worker *w) {
+    int fd;
+    uint64_t cap = 1;
+    char path[PATH_MAX];
+    struct trace_ring *t;
+
+    while (cap < (uint64_t)cfg.trace_records) {
+        cap *= 2;
+    }
+
+    if ((t = calloc(1, sizeof(*t))) == NULL) {
+        perror("[!] calloc()");
+        exit(EXIT_FAILURE);
+    }
+    t->size = sizeof(struct trace_header) + cap * sizeof(struct trace_record);
+
+    snprintf(path, sizeof(path), "%s.%d", trace_path, w->id);
+    if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0 || ftruncate(fd, t->size) < 0 ||
+        (t->hdr = mmap(NULL, t->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        perror("[!] trace file");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+
+    memcpy(t->hdr->magic, TRACE_MAGIC, sizeof(t->hdr->magic));
+    t->hdr->version = TRACE_VERSION;
+    t->hdr->worker = w->id;
+    t->hdr->capacity = cap;
+    t->hdr->tsc_hz = trace_hz;
+    t->hdr->head = 0;
+    t->recs = (struct trace_record *)(t->hdr + 1);
+    t->mask = cap - 1;
+
+    if (verbose) {
+        printf("[+] worker %d traces to %s (%lu records)\n", w->id, path, cap);
+    }
+    return t;
+}
+
+static void trace_close(struct trace_ring *t) {
+    munmap(t->hdr, t->size);
+    free(t);
+}
+#endif
+
+/*
+ * Pin the calling worker thread and switch it to node-local memory allocation.
+ * Everything the worker allocates afterwards (buffers, connections) is then
+ * placed on the NUMA node of its CPU instead of the node of the main thread.
+ */
+static void worker_pin(struct worker *w) {
+    cpu_set_t set;
+
+    if (w->cpu < 0) {
+        return;
+    }
+
+    CPU_ZERO(&set);
+    CPU_SET(w->cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        fprintf(stderr, "[!] cannot pin worker %d to CPU %d\n", w->id, w->cpu);
+        return;
+    }
+
+    if (syscall(SYS_set_mempolicy, MPOL_LOCAL, NULL, 0) < 0) {
+        perror("[!] set_mempolicy()");
+    }
+}
+
+// Handle the events of a client socket reported by the wakeup at `start`, which may close it
+static void worker_conn_event(struct worker *w, struct conn *c, uint32_t events, uint64_t start) {
+    /* handle EPOLLIN and EPOLLOUT events */
+    // Reading also handles EOF, so a half-closed peer still gets its last responses
+    if ((events & EPOLLIN) && (reactor->send != NULL ? conn_received(w, c) : conn_read(w, c)) < 0) {
+        conn_close(w, c);
+        return;
+    }
+
+    // Continue flushing responses that did not fit into the kernel buffer
+    if ((events & EPOLLOUT) && conn_flush(w, c) < 0) {
+        conn_close(w, c);
+        return;
+    }
+
+    /* check if the connection is closing */
+    // An admin connection is done once its response is out
+    if ((events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) ||
+        (c->admin == ADMIN_DONE && c->async == 0 && buffer_size(&c->out) == 0)) {
+        conn_close(w, c);
+        return;
+    }
+
+    if (cfg.admin_port > 0) {
+        stat_latency(&w->stats, now_ns() - start);
+        if (!c->admin) {
+            conn_rank(w, c, start);
+        }
+    }
+    conn_watch(w, c);
+}
+
+static void *worker_run(void *arg) {
+    int i;
+    int fd;
+    int nfds;
+    int woken;
+    int timed = cfg.rebalance_ms > 0 || cfg.admin_port > 0;
+    uint64_t start = 0;
+    struct conn *c;
+    struct worker *to;
+    struct worker *w = arg;
+
+    // Allocate the worker's memory only after pinning, so it is local to its CPU
+    worker_pin(w);
+    w->rbuf = malloc(cfg.read_size);
+    w->events = calloc(cfg.events, sizeof(*w->events));
+    if (w->rbuf == NULL || w->events == NULL) {
+        perror("[!] malloc()");
+        exit(EXIT_FAILURE);
+    }
+    buffer_pool_init(&w->pool, cfg.ring_buffers);
+    if (cfg.perf_counters) { // Counts this thread only, so it is opened here
+        w->perf = perf_open(w);
+    }
+#ifdef EPOLL_TRACE
+    if (trace_path != NULL) {
+        w->trace = trace_open(w);
+    }
+#endif
+
+    // Start to handle the events
+    while (!stop_requested) {
+        // Wait for events on the reactor
+        TRACE(w, TRACE_WAIT_BEGIN, -1, 0);
+        nfds = reactor->wait(w);
+        TRACE(w, TRACE_WAIT_END, -1, nfds > 0 ? nfds : 0);
+        if (nfds < 0) {
+            if (errno != EINTR) {
+                perror("[!] reactor wait");
+                break;
+            }
+            continue;
+        }
+
+        stat_add(&w->stats.wakeups, 1);
+        stat_add(&w->stats.events, nfds);
+        if (timed) {
+            start = now_ns();
+        }
+
+        woken = 0;
+        for (i = 0; i < nfds; i++) {
+            fd = w->events[i].data.fd;
+            if (fd == w->listen_sock) { // The listen socket is ready for read
+                worker_accept(w);
+            } else if (fd == w->admin_sock) { // A connection to the admin endpoint
+                admin_accept(w);
+            } else if (fd == w->wake_fd) { // New connections were handed over or a move was requested
+                worker_inbox(w);
+                woken = 1;
+            } else if (fd == w->async_fd) { // The async pool finished requests of this worker
+                worker_async(w);
+            } else if (fd == stop_fd) { // The server is shutting down
+                break;
+            } else if (fd == STDIN_FILENO) { // The stdin is ready for read
+                worker_stdin(w);
+            } else if ((c = conn_lookup(fd)) != NULL) { // A client socket is ready
+                if (w->perf != NULL) {
+                    perf_begin(w);
+                    worker_conn_event(w, c, w->events[i].events, start);
+                    perf_end(w);
+                } else {
+                    worker_conn_event(w, c, w->events[i].events, start);
+                }
+            } else {
+                printf("[+] unexpected\n");
+            }
+        }
+
+        // Only after the batch, which may still hold events of the connections to be moved
+        if (woken && (to = atomic_exchange_explicit(&w->steal_to, NULL, memory_order_acquire)) != NULL) {
+            worker_migrate(w, to);
+        }
+
+        if (cfg.admin_port > 0 && start - w->window_start >= TOP_WINDOW_NS) {
+            worker_rotate_top(w, start);
+        }
+
+        if (timed) {
+            atomic_fetch_add_explicit(&w->busy_ns, now_ns() - start, memory_order_relaxed);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Steer every new connection to the worker pinned to the CPU that received it.
+ * The classic BPF program returns an index into the SO_REUSEPORT group, which
+ * is the order the listeners were created in, i.e. the worker id:
+ *
+ *     A = cpu
+ *     if (A == cpu of worker 0) return 0
+ *     ...
+ *     return A % workers            (CPUs without a pinned worker)
+ */
+static void attach_reuseport_cbpf(struct worker *workers) {
+    int i;
+    int n = 0;
+    struct sock_filter *code;
+    struct sock_fprog prog;
+
+    if ((code = calloc(2 * cfg.workers + 3, sizeof(*code))) == NULL) {
+        perror("[!] calloc()");
+        exit(EXIT_FAILURE);
+    }
+
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+    for (i = 0; i < cfg.workers; i++) {
+        if (workers[i].cpu < 0) {
+            continue;
+        }
+        code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, workers[i].cpu, 0, 1);
+        code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, i);
+    }
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, cfg.workers);
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+
+    prog.len = n;
+    prog.filter = code;
+
+    // The program belongs to the whole group, attaching it to one listener is enough
+    if (setsockopt(workers[0].listen_sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0) {
+        perror("[!] SO_ATTACH_REUSEPORT_CBPF");
+    } else if (verbose) {
+        printf("[+] reuseport CPU steering program attached (%d instructions)\n", n);
+    }
+
+    free(code);
+}
+
+/*
+ * Acceptor thread of the handoff mode. It owns the only listener, accepts on the
+ * usual path and pushes each connection to the inbox of the least loaded worker.
+ * Workers are signalled once per drained accept queue, not once per connection.
+ */
+struct acceptor {
+    pthread_t tid;
+    int epfd;
+    int listen_sock;
+    struct worker *workers;
+    char *pending;  // Workers that got connections since they were last signalled
+    int next;       // Where the next least-loaded scan starts, so ties go round-robin
+};
+
+static struct worker *acceptor_pick(struct acceptor *a) {
+    int i;
+    int id;
+    int load;
+    int best = a->next;
+    int best_load = atomic_load_explicit(&a->workers[best].load, memory_order_relaxed);
+
+    for (i = 1; i < cfg.workers && best_load > 0; i++) {
+        id = (a->next + i) % cfg.workers;
+        load = atomic_load_explicit(&a->workers[id].load, memory_order_relaxed);
+        if (load < best_load) {
+            best = id;
+            best_load = load;
+        }
+    }
+
+    a->next = (a->next + 1) % cfg.workers;
+    return &a->workers[best];
+}
+
+static void acceptor_accept(struct acceptor *a) {
+    int i;
+    int conn_sock;
+    uint64_t one = 1;
+    struct worker *w;
+
+    while ((conn_sock = accept_conn(a->listen_sock)) >= 0) {
+        w = acceptor_pick(a);
+
+        // Counted before the worker sees it, so a burst of accepts spreads over the workers
+        atomic_fetch_add_explicit(&w->load, 1, memory_order_relaxed);
+        if (fd_queue_push(&w->inbox, conn_sock) < 0) {
+            atomic_fetch_sub_explicit(&w->load, 1, memory_order_relaxed);
+            fprintf(stderr, "[!] inbox of worker %d is full, dropping a connection\n", w->id);
+            close(conn_sock);
+            continue;
+        }
+        a->pending[w->id] = 1;
+    }
+
+    for (i = 0; i < cfg.workers; i++) {
+        if (a->pending[i]) {
+            a->pending[i] = 0;
+            if (write(a->workers[i].wake_fd, &one, sizeof(one)) < 0) {
+                perror("[!] write(wake_fd)");
+            }
+        }
+    }
+}
+
+static void *acceptor_run(void *arg) {
+    int nfds;
+    struct epoll_event ev;
+    struct acceptor *a = arg;
+
+    while (!stop_requested) {
+        if ((nfds = epoll_wait(a->epfd, &ev, 1, -1)) < 0) {
+            if (errno != EINTR) {
+                perror("[!] epoll_wait()");
+                break;
+            }
+            continue;
+        }
+
+        if (nfds == 1 && ev.data.fd == a->listen_sock) {
+            acceptor_accept(a);
+        }
+    }
+
+    return NULL;
+}
+
+static void acceptor_init(struct acceptor *a, struct worker *workers, int listen_sock) {
+    a->workers = workers;
+    a->next = 0;
+    a->listen_sock = listen_sock;
+
+    if ((a->pending = calloc(cfg.workers, 1)) == NULL) {
+        perror("[!] calloc()");
+        exit(EXIT_FAILURE);
+    }
+
+    if ((a->epfd = epoll_create(1)) == -1) {
+        perror("[!] Cannot create epoll file descriptor\n");
+        exit(EXIT_FAILURE);
+    }
+    epoll_ctl_add(a->epfd, a->listen_sock, EPOLLIN | EPOLLET);
+    epoll_ctl_add(a->epfd, stop_fd, EPOLLIN);
+}
+
+/*
+ * Rebalancer thread (--rebalance-ms). Connections are assigned once, at accept
+ * time, and long-lived ones keep a worker busy however the others are doing.
+ * Every interval the rebalancer compares how much of it each worker spent
+ * handling events. When the busiest worker is more than --rebalance-skew percent
+ * busier than the idlest one, it asks the busiest to move half the difference
+ * of its requests over, which leaves both at their mean.
+ */
+struct rebalancer {
+    pthread_t tid;
+    int epfd;
+    int tfd;            // Periodic timerfd
+    struct worker *workers;
+    uint64_t *busy;     // busy_ns of every worker at the last tick
+    uint64_t last;      // Time of the last tick
+    int moves;          // Moves requested so far
+};
+
+static void rebalancer_tick(struct rebalancer *r) {
+    int i;
+    uint64_t one = 1;
+    uint64_t busy;
+    uint64_t now = now_ns();
+    double util;
+    double hot_util = -1;
+    double cold_util = 2;
+    struct worker *hot = NULL;
+    struct worker *cold = NULL;
+
+    for (i = 0; i < cfg.workers; i++) {
+        busy = atomic_load_explicit(&r->workers[i].busy_ns, memory_order_relaxed);
+        util = (double)(busy - r->busy[i]) / (now - r->last);
+        r->busy[i] = busy;
+
+        if (util > hot_util) {
+            hot_util = util;
+            hot = &r->workers[i];
+        }
+        if (util < cold_util) {
+            cold_util = util;
+            cold = &r->workers[i];
+        }
+    }
+    r->last = now;
+
+    // Leave a nearly idle server alone, and wait until the previous move has been made
+    if (hot == cold || hot_util < 0.05 || hot_util - cold_util <= hot_util * cfg.rebalance_skew / 100 ||
+        atomic_load_explicit(&hot->steal_to, memory_order_relaxed) != NULL) {
+        return;
+    }
+
+    atomic_store_explicit(&hot->steal_permille, (int)(1000 * (hot_util - cold_util) / (2 * hot_util)),
+                          memory_order_relaxed);
+    atomic_store_explicit(&hot->steal_to, cold, memory_order_release);
+    if (write(hot->wake_fd, &one, sizeof(one)) < 0) {
+        perror("[!] write(wake_fd)");
+    }
+    r->moves++;
+
+    if (verbose) {
+        printf("[+] rebalance: worker %d %.0f%% busy, worker %d %.0f%% busy\n",
+               hot->id, hot_util * 100, cold->id, cold_util * 100);
+    }
+}
+
+static void *rebalancer_run(void *arg) {
+    uint64_t ticks;
+    struct epoll_event ev;
+    struct rebalancer *r = arg;
+
+    r->last = now_ns();
+    while (!stop_requested) {
+        if (epoll_wait(r->epfd, &ev, 1, -1) < 0) {
+            if (errno != EINTR) {
+                perror("[!] epoll_wait()");
+                break;
+            }
+            continue;
+        }
+
+        if (ev.data.fd == r->tfd && read(r->tfd, &ticks, sizeof(ticks)) == sizeof(ticks)) {
+            rebalancer_tick(r);
+        }
+    }
+
+    return NULL;
+}
+
+static void rebalancer_init(struct rebalancer *r, struct worker *workers) {
+    struct itimerspec its;
+
+    r->workers = workers;
+    r->moves = 0;
+    if ((r->busy = calloc(cfg.workers, sizeof(*r->busy))) == NULL) {
+        perror("[!] calloc()");
+        exit(EXIT_FAILURE);
+    }
+
+    if ((r->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) == -1) {
+        perror("[!] timerfd_create()");
+        exit(EXIT_FAILURE);
+    }
+    its.it_interval.tv_sec = cfg.rebalance_ms / 1000;
+    its.it_interval.tv_nsec = (cfg.rebalance_ms % 1000) * 1000000L;
+    its.it_value = its.it_interval;
+    timerfd_settime(r->tfd, 0, &its, NULL);
+
+    if ((r->epfd = epoll_create(1)) == -1) {
+        perror("[!] Cannot create epoll file descriptor\n");
+        exit(EXIT_FAILURE);
+    }
+    epoll_ctl_add(r->epfd, r->tfd, EPOLLIN);
+    epoll_ctl_add(r->epfd, stop_fd, EPOLLIN);
+}
+
+void server_run() {
+    int i;
+    int fd;
+    int shared_sock = -1;
+    struct worker *workers;
+    struct acceptor acceptor;
+    struct rebalancer rebalancer;
+    struct sigaction sa;
+
+    conns_init();
+    reactor = &reactors[cfg.reactor];
+#ifdef EPOLL_TRACE
+    if (trace_path != NULL) {
+        trace_calibrate();
+    }
+#endif
+
+    if ((stop_fd = eventfd(0, EFD_NONBLOCK)) == -1) {
+        perror("[!] eventfd()");
+        exit(EXIT_FAILURE);
+    }
+
+    // Cache line aligned, see struct worker
+    if ((workers = aligned_alloc(64, cfg.workers * sizeof(*workers))) == NULL) {
+        perror("[!] aligned_alloc()");
+        exit(EXIT_FAILURE);
+    }
+    bzero(workers, cfg.workers * sizeof(*workers));
+    server_workers = workers;
+
+    // Every listener is bound before any worker starts, so a bind error stops the server early
+    if (cfg.accept_mode != ACCEPT_REUSEPORT) {
+        shared_sock = create_listener(-1);
+    }
+    for (i = 0; i < cfg.workers; i++) {
+        worker_init(&workers[i], i, cfg.accept_mode == ACCEPT_EXCLUSIVE ? shared_sock : -1);
+    }
+    if (cfg.accept_mode == ACCEPT_HANDOFF) {
+        acceptor_init(&acceptor, workers, shared_sock);
+    }
+    if (cfg.rebalance_ms > 0 && cfg.workers > 1) {
+        rebalancer_init(&rebalancer, workers);
+    }
+
+    if (cfg.reuseport_cbpf && cfg.accept_mode == ACCEPT_REUSEPORT && cfg.workers > 1) {
+        attach_reuseport_cbpf(workers);
+    }
+
+    // Leave the loop on SIGINT/SIGTERM instead of being killed
+    bzero(&sa, sizeof(sa));
+    sa.sa_handler = on_stop_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    if (verbose) {
+        printf("[+] %d worker(s), %s reactor, %s accept, backlog %d, %d events per wait, %d byte reads\n",
+               cfg.workers, reactor->name, accept_modes[cfg.accept_mode], cfg.backlog, cfg.events, cfg.read_size);
+        for (i = 0; i < cfg.workers && cpu_count > 0; i++) {
+            printf("[+] worker %d pinned to CPU %d\n", i, workers[i].cpu);
+        }
+        if (cfg.admin_port > 0) {
+            printf("[+] metrics on http://%s:%d/metrics\n", inet_ntoa(*(struct in_addr *)&address), cfg.admin_port);
+        }
+    }
+
+    if (cfg.async_threads > 0) {
+        async_pool_start();
+    }
+
+    // Worker 0 runs on the main thread
+    for (i = 1; i < cfg.workers; i++) {
+        if (pthread_create(&workers[i].tid, NULL, worker_run, &workers[i]) != 0) {
+            perror("[!] pthread_create()");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (cfg.accept_mode == ACCEPT_HANDOFF && pthread_create(&acceptor.tid, NULL, acceptor_run, &acceptor) != 0) {
+        perror("[!] pthread_create()");
+        exit(EXIT_FAILURE);
+    }
+    if (cfg.rebalance_ms > 0 && cfg.workers > 1 &&
+        pthread_create(&rebalancer.tid, NULL, rebalancer_run, &rebalancer) != 0) {
+        perror("[!] pthread_create()");
+        exit(EXIT_FAILURE);
+    }
+    worker_run(&workers[0]);
+
+    for (i = 1; i < cfg.workers; i++) {
+        pthread_join(workers[i].tid, NULL);
+    }
+
+    printf("[+] shutting down\n");
+    if (cfg.async_threads > 0) {
+        async_pool_stop(workers);
+    }
+    if (cfg.perf_counters) {
+        perf_report(workers);
+    }
+    if (cfg.accept_mode == ACCEPT_HANDOFF) {
+        pthread_join(acceptor.tid, NULL);
+        close(acceptor.epfd);
+        free(acceptor.pending);
+    }
+    if (cfg.rebalance_ms > 0 && cfg.workers > 1) {
+        pthread_join(rebalancer.tid, NULL);
+        printf("[+] rebalancer requested %d move(s)\n", rebalancer.moves);
+        close(rebalancer.tfd);
+        close(rebalancer.epfd);
+        free(rebalancer.busy);
+    }
+    if (shared_sock >= 0) {
+        close(shared_sock);
+    }
+    for (i = 0; i < cfg.workers; i++) {
+        if (cfg.accept_mode == ACCEPT_REUSEPORT) {
+            close(workers[i].listen_sock); // Close the listen socket
+        }
+        while ((fd = fd_queue_pop(&workers[i].inbox)) >= 0) { // Handed over but never registered
+            close(fd);
+        }
+        if (workers[i].admin_sock >= 0) {
+            close(workers[i].admin_sock);
+        }
+        close(workers[i].wake_fd);
+        close(workers[i].async_fd);
+        free(workers[i].inbox.slots);
+        reactor->free(&workers[i]);
+        if (workers[i].perf != NULL) {
+            perf_close(workers[i].perf);
+        }
+#ifdef EPOLL_TRACE
+        if (workers[i].trace != NULL) {
+            trace_close(workers[i].trace);
+        }
+#endif
+        free(workers[i].rbuf);
+        free(workers[i].events);
+        buffer_pool_free(&workers[i].pool);
+    }
+    for (i = 0; i < cfg.workers; i++) { // Pools may hold buffers of any worker's arena
+        buffer_pool_unmap(&workers[i].pool);
+    }
+    close(stop_fd);
+    free(workers);
+}
+
+/*
+ * Interactive and scripted client.
+ * stdin and the socket are multiplexed by epoll so that up to `window` requests
+ * are in flight at once; responses are matched to requests by their terminator.
+ */
+struct client {
+    int epfd;
+    int sockfd;
+    int stdin_polled;   // stdin is registered in epoll (terminals and pipes, not regular files)
+    int stdin_open;     // More requests may still come from stdin
+    int stdin_armed;    // EPOLLIN on stdin is currently enabled
+    int interactive;    // Print the prompt when waiting for the user
+    int outstanding;    // Requests sent without a response yet
+    struct buffer line; // Input from stdin not yet sent
+    struct buffer in;   // Partial response from the server
+    struct buffer out;  // Requests not yet accepted by the socket
+};
+
+static void client_prompt(struct client *cl) {
+    if (cl->interactive && cl->stdin_open && cl->outstanding == 0) {
+        printf("input: ");
+        fflush(stdout);
+    }
+}
+
+// Move complete lines from stdin into the send queue while the window allows
+static void client_queue_lines(struct client *cl) {
+    char *start;
+    char *end;
+    char term = '\0';
+
+    while (cl->outstanding < window && buffer_size(&cl->line) > 0) {
+        start = cl->line.data + cl->line.off;
+        if ((end = memchr(start, '\n', buffer_size(&cl->line))) == NULL) {
+            if (cl->stdin_open) {
+                break; // Wait for the rest of the line
+            }
+            end = cl->line.data + cl->line.len; // Send the last line even without a newline
+        }
+
+        if (end - start == 4 && memcmp(start, "exit", 4) == 0) { // Check if the input is "exit"
+            cl->stdin_open = 0;
+            cl->line.off = cl->line.len = 0; // Ignore whatever follows
+            break;
+        }
+
+        // Send the line terminated by the null character
+        buffer_append(&cl->out, start, end - start);
+        buffer_append(&cl->out, &term, 1);
+        cl->outstanding++;
+
+        buffer_consume(&cl->line, end < cl->line.data + cl->line.len ? end - start + 1 : end - start);
+    }
+}
+
+// Read a chunk of stdin, return -1 on EOF
+static int client_read_stdin(struct client *cl) {
+    int n;
+    char buf[MAX_LINE];
+
+    if ((n = read(STDIN_FILENO, buf, sizeof(buf))) < 0) {
+        if (errno == EAGAIN || errno == EINTR) {
+            return 0;
+        }
+
+        perror("[!] read(stdin)");
+        return -1;
+    } else if (n == 0) {
+        return -1;
+    }
+
+    buffer_append(&cl->line, buf, n);
+    return 0;
+}
+
+// Read and print every complete response, return -1 if the server closed the connection
+static int client_read_sock(struct client *cl) {
+    int n;
+    char buf[MAX_LINE];
+    char *start;
+    char *end;
+
+    for (;;) {
+        if ((n = read(cl->sockfd, buf, sizeof(buf))) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            } else if (errno == EINTR) {
+                continue;
+            }
+
+            perror("[!] read()");
+            return -1;
+        } else if (n == 0) {
+            return -1;
+        }
+
+        buffer_append(&cl->in, buf, n);
+
+        // Each null-terminated response completes the oldest outstanding request
+        for (;;) {
+            start = cl->in.data + cl->in.off;
+            if ((end = memchr(start, '\0', buffer_size(&cl->in))) == NULL) {
+                break;
+            }
+
+            printf("echo: %s\n", start);
+            buffer_consume(&cl->in, end - start + 1);
+
+            if (cl->outstanding > 0) {
+                cl->outstanding--;
+            }
+            client_prompt(cl);
+        }
+    }
+}
+
+void client_run() {
+    int i;
+    int nfds;
+    int want;
+    struct client cl;
+    struct sockaddr_in srv_addr;
+    struct epoll_event ev;
+    struct epoll_event events[MAX_EVENTS];
+
+    bzero(&cl, sizeof(cl));
+    cl.stdin_open = 1;
+    cl.interactive = isatty(STDIN_FILENO);
+
+    // Create a socket using TCP protocol in IPv4 domain & get the file descriptor
+    cl.sockfd = socket(AF_INET, SOCK_STREAM, 0);
+
+    // Set the socket address & port information for the server
+    set_sockaddr(&srv_addr);
+
+    // Connect to the server
+    if (connect(cl.sockfd, (struct sockaddr *)&srv_addr, sizeof(srv_addr)) < 0) {
+        perror("cannot connect to the server\n");
+        exit(1);
+    }
+
+    // Requests are written as soon as there is room and responses read as they arrive
+    setnonblocking(cl.sockfd);
+
+    if ((cl.epfd = epoll_create(1)) == -1) {
+        perror("[!] Cannot create epoll file descriptor\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // The socket is edge-triggered; EPOLLOUT fires when a blocked send queue drains
+    epoll_ctl_add(cl.epfd, cl.sockfd, EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP);
+
+    // stdin is level-triggered so that reading can pause while the window is full
+    // Regular files cannot be added to epoll (EPERM); they are always ready anyway
+    ev.events = EPOLLIN;
+    ev.data.fd = STDIN_FILENO;
+    if (epoll_ctl(cl.epfd, EPOLL_CTL_ADD, STDIN_FILENO, &ev) == 0) {
+        cl.stdin_polled = 1;
+        cl.stdin_armed = 1;
+    } else if (errno != EPERM) {
+        perror("epoll_ctl()\n");
+        exit(EXIT_FAILURE);
+    }
+
+    client_prompt(&cl);
+
+    // Start the communication with the server
+    for (;;) {
+        client_queue_lines(&cl);
+        if (buffer_flush(&cl.out, cl.sockfd) < 0) {
+            perror("[!] write()");
+            break;
+        }
+
+        // Done once stdin is exhausted and every request has been answered
+        if (!cl.stdin_open && cl.outstanding == 0 && buffer_size(&cl.line) == 0) {
+            break;
+        }
+
+        // Only read more input while there is room in the window and no complete line is waiting
+        want = cl.stdin_open && cl.outstanding < window &&
+            memchr(cl.line.data + cl.line.off, '\n', buffer_size(&cl.line)) == NULL;
+
+        if (!cl.stdin_polled) {
+            if (want && client_read_stdin(&cl) < 0) {
+                cl.stdin_open = 0;
+            }
+        } else if (want != cl.stdin_armed) {
+            ev.events = want ? EPOLLIN : 0;
+            ev.data.fd = STDIN_FILENO;
+            epoll_ctl(cl.epfd, EPOLL_CTL_MOD, STDIN_FILENO, &ev);
+            cl.stdin_armed = want;
+        }
+
+        // Do not block while an unpolled stdin still has data to give
+        nfds = epoll_wait(cl.epfd, events, MAX_EVENTS, (!cl.stdin_polled && want) ? 0 : -1);
+        if (nfds < 0 && errno != EINTR) {
+            perror("[!] epoll_wait()");
+            break;
+        }
+
+        for (i = 0; i < nfds; i++) {
+            if (events[i].data.fd == STDIN_FILENO) {
+                if (client_read_stdin(&cl) < 0) {
+                    cl.stdin_open = 0;
+                    epoll_ctl(cl.epfd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+                    cl.stdin_polled = 0;
+                }
+            } else if (events[i].data.fd == cl.sockfd) {
+                if (client_read_sock(&cl) < 0) {
+                    printf("[!] server closed the connection\n");
+                    cl.stdin_open = 0;
+                    cl.outstanding = 0;
+                    cl.line.off = cl.line.len = 0;
+                }
+            }
+        }
+    }
+
+    // Close the file descriptor
+    close(cl.sockfd);
+    close(cl.epfd);
+    buffer_free(&cl.line);
+    buffer_free(&cl.in);
+    buffer_free(&cl.out);
+}
+
+/*
+ * Latency histogram with log-linear buckets (in the spirit of HdrHistogram).
+ * Every power of two is split into 2^HIST_SUB_BITS linear sub-buckets, so each
+ * recorded value is kept with better than 1% precision from 1 ns up to hours.
+ */
+#define HIST_SUB_BITS   7
+#define HIST_SUB_COUNT  (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS    ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+struct hist {
+    uint64_t count;
+    uint64_t min;
+    uint64_t max;
+    uint64_t counts[HIST_BUCKETS];
+};
+
+static int hist_index(uint64_t v) {
+    int shift;
+
+    if (v < HIST_SUB_COUNT) {
+        return (int)v;
+    }
+
+    shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) + (int)((v >> shift) - HIST_SUB_COUNT);
+}
+
+// Highest value that falls into the bucket
+static uint64_t hist_value(int idx) {
+    int shift;
+
+    if (idx < HIST_SUB_COUNT) {
+        return idx;
+    }
+
+    shift = (idx >> HIST_SUB_BITS) - 1;
+    return ((uint64_t)((idx & (HIST_SUB_COUNT - 1)) + HIST_SUB_COUNT) << shift) + ((1ULL << shift) - 1);
+}
+
+static void hist_record(struct hist *h, uint64_t v) {
+    h->counts[hist_index(v)]++;
+    if (h->count == 0 || v < h->min) {
+        h->min = v;
+    }
+    if (v > h->max) {
+        h->max = v;
+    }
+    h->count++;
+}
+
+static uint64_t hist_percentile(const struct hist *h, double pct) {
+    int i;
+    uint64_t seen = 0;
+    uint64_t rank = (uint64_t)(pct / 100.0 * h->count + 0.5);
+
+    if (h->count == 0) {
+        return 0;
+    }
+    if (rank == 0) {
+        rank = 1;
+    }
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        if ((seen += h->counts[i]) >= rank) {
+            return hist_value(i) < h->max ? hist_value(i) : h->max;
+        }
+    }
+
+    return h->max;
+}
+
+static void hist_merge(struct hist *dst, const struct hist *src) {
+    int i;
+
+    if (src->count == 0) {
+        return;
+    }
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        dst->counts[i] += src->counts[i];
+    }
+    if (dst->count == 0 || src->min < dst->min) {
+        dst->min = src->min;
+    }
+    if (src->max > dst->max) {
+        dst->max = src->max;
+    }
+    dst->count += src->count;
+}
+
+static void hist_print(const char *name, const struct hist *h) {
+    printf("[bench] %-12s p50 %.1f us, p90 %.1f us, p99 %.1f us, p99.9 %.1f us, p99.99 %.1f us, max %.1f us\n",
+           name,
+           hist_percentile(h, 50) / 1e3, hist_percentile(h, 90) / 1e3, hist_percentile(h, 99) / 1e3,
+           hist_percentile(h, 99.9) / 1e3, hist_percentile(h, 99.99) / 1e3, h->max / 1e3);
+}
+
+// Write the distribution in the HdrHistogram percentile format (values in microseconds)
+static int hist_write(const struct hist *h, const char *path) {
+    int i;
+    uint64_t seen = 0;
+    double pct;
+    FILE *fp;
+
+    if ((fp = fopen(path, "w")) == NULL) {
+        return -1;
+    }
+
+    fprintf(fp, "%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount", "1/(1-Percentile)");
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        if (h->counts[i] == 0) {
+            continue;
+        }
+
+        seen += h->counts[i];
+        pct = (double)seen / h->count;
+        if (seen < h->count) {
+            fprintf(fp, "%12.3f %14.12f %10llu %14.2f\n", hist_value(i) / 1e3, pct,
+                    (unsigned long long)seen, 1.0 / (1.0 - pct));
+        } else {
+            fprintf(fp, "%12.3f %14.12f %10llu %14s\n", h->max / 1e3, pct, (unsigned long long)seen, "inf");
+        }
+    }
+    fprintf(fp, "#[Max     = %12.3f, Total count    = %12llu]\n", h->max / 1e3, (unsigned long long)h->count);
+
+    return fclose(fp);
+}
+
+// xorshift64* generator, cheap and good enough for inter-arrival times
+static uint64_t rng_next(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+/*
+ * Benchmark connection.
+ * Responses arrive in request order, so the send timestamps are kept in a FIFO
+ * and every '\0' read from the socket completes the oldest one.
+ */
+struct bench_stamp {
+    uint64_t intended; // When the schedule wanted the request to go out
+    uint64_t sent;     // When the request was actually queued
+};
+
+struct bench_conn {
+    int fd;
+    size_t rx;  // Bytes of a binary response received so far
+    struct buffer out;
+    struct bench_stamp *fifo;
+    size_t head;
+    size_t tail;
+    size_t cap; // Power of two
+};
+
+static void bench_conn_push(struct bench_conn *bc, uint64_t intended, uint64_t sent) {
+    size_t i;
+    size_t n = bc->tail - bc->head;
+    struct bench_stamp *fifo;
+
+    if (n == bc->cap) { // Grow the ring and unwrap it
+        size_t cap = bc->cap ? bc->cap * 2 : 64;
+        if ((fifo = malloc(cap * sizeof(*fifo))) == NULL) {
+            perror("[!] malloc()");
+            exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < n; i++) {
+            fifo[i] = bc->fifo[(bc->head + i) & (bc->cap - 1)];
+        }
+        free(bc->fifo);
+        bc->fifo = fifo;
+        bc->cap = cap;
+        bc->head = 0;
+        bc->tail = n;
+    }
+
+    bc->fifo[bc->tail & (bc->cap - 1)].intended = intended;
+    bc->fifo[bc->tail & (bc->cap - 1)].sent = sent;
+    bc->tail++;
+}
+
+static int bench_connect(void) {
+    int fd;
+    int one = 1;
+    struct sockaddr_in srv_addr;
+
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        perror("[!] Cannot create socket file descriptor\n");
+        exit(EXIT_FAILURE);
+    }
+
+    set_sockaddr(&srv_addr);
+    if (connect(fd, (struct sockaddr *)&srv_addr, sizeof(srv_addr)) < 0) {
+        perror("cannot connect to the server\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Requests are small and latency matters, do not let Nagle hold them back
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setnonblocking(fd);
+
+    return fd;
+}
+
+/*
+ * Load generation thread.
+ * Each thread owns a disjoint slice of the connections, its own epoll instance,
+ * schedule timer and histograms; nothing is shared until the results are merged.
+ *
+ * Open loop ("open"): requests are issued on a fixed timeline (constant or Poisson
+ * arrivals) no matter how fast the server answers. Latency is measured from the
+ * intended send time, so a server stall is charged to every request that should
+ * have been sent during it (coordinated-omission correction); the uncorrected
+ * latency from the actual send time is recorded alongside for comparison.
+ *
+ * Closed loop ("pipe"): every connection keeps `window` requests in flight and
+ * sends a new one as soon as a response comes back, to find the peak throughput.
+ */
+struct loadgen {
+    pthread_t tid;
+    int epfd;
+    int tfd;
+    int nconns;
+    int open_loop;
+    double rate;            // Requests per second of this thread (open loop)
+    uint64_t start;
+    uint64_t end;
+    uint64_t rng;
+    uint64_t sent;
+    uint64_t received;
+    uint64_t outstanding;
+    const char *reqs;       // `window` back-to-back requests, sent by prefix
+    size_t req_len;         // Size of a single request including its terminator or header
+    int binary;             // Responses are counted by size, every binary echo is as long as its request
+    struct bench_conn *conns;
+    struct hist corrected;   // From the intended send time
+    struct hist uncorrected; // From the actual send time
+};
+
+// Queue `k` requests on a connection, all intended for `intended`
+static void loadgen_send(struct loadgen *lg, struct bench_conn *bc, int k, uint64_t intended, uint64_t now) {
+    int i;
+
+    buffer_append(&bc->out, lg->reqs, k * lg->req_len);
+    for (i = 0; i < k; i++) {
+        bench_conn_push(bc, intended, now);
+    }
+    lg->sent += k;
+    lg->outstanding += k;
+}
+
+// Read responses from a connection, return the number of completed requests
+static int loadgen_read(struct loadgen *lg, struct bench_conn *bc) {
+    int n;
+    int k;
+    int done = 0;
+    char buf[MAX_LINE * 64];
+    char *p;
+    uint64_t now;
+    struct bench_stamp *st;
+
+    for (;;) {
+        if ((n = read(bc->fd, buf, sizeof(buf))) < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                break;
+            }
+            perror("[!] read()");
+            exit(EXIT_FAILURE);
+        } else if (n == 0) {
+            fprintf(stderr, "[!] server closed the connection\n");
+            exit(EXIT_FAILURE);
+        }
+
+        // Every terminator completes the oldest request of the connection; a binary echo
+        // is exactly as long as its request, so there it is every req_len bytes
+        if (lg->binary) {
+            bc->rx += n;
+            k = bc->rx / lg->req_len;
+            bc->rx %= lg->req_len;
+        } else {
+            for (k = 0, p = buf; (p = memchr(p, '\0', buf + n - p)) != NULL; p++) {
+                k++;
+            }
+        }
+
+        now = now_ns();
+        for (; k > 0; k--) {
+            st = &bc->fifo[bc->head++ & (bc->cap - 1)];
+            hist_record(&lg->corrected, now - st->intended);
+            hist_record(&lg->uncorrected, now - st->sent);
+            done++;
+        }
+    }
+
+    lg->received += done;
+    lg->outstanding -= done;
+    return done;
+}
+
+static void *loadgen_run(void *arg) {
+    int i;
+    int k;
+    int nfds;
+    int sending = 1;
+    size_t rr = 0;
+    uint64_t now;
+    uint64_t next;
+    uint64_t expirations;
+    uint64_t interval;
+    struct loadgen *lg = arg;
+    struct bench_conn *bc;
+    struct itimerspec its;
+    struct epoll_event events[MAX_EVENTS];
+
+    bzero(&its, sizeof(its));
+    interval = (uint64_t)(1e9 / lg->rate);
+    next = lg->start;
+
+    // A closed loop starts with a full window on every connection
+    if (!lg->open_loop) {
+        now = now_ns();
+        for (i = 0; i < lg->nconns; i++) {
+            loadgen_send(lg, &lg->conns[i], window, now, now);
+        }
+    }
+
+    for (;;) {
+        now = now_ns();
+        if (now >= lg->end) {
+            sending = 0;
+        }
+
+        // Issue every request whose intended send time has passed, catching up after a stall
+        while (lg->open_loop && sending && next <= now) {
+            if (next >= lg->end) {
+                sending = 0;
+                break;
+            }
+
+            loadgen_send(lg, &lg->conns[rr++ % lg->nconns], 1, next, now);
+
+            if (bench.poisson) { // Exponential inter-arrival time, U in (0, 1]
+                next += (uint64_t)(-log((double)((rng_next(&lg->rng) >> 11) + 1) / 9007199254740992.0) * 1e9 / lg->rate);
+            } else {
+                next += interval;
+            }
+        }
+
+        for (i = 0; i < lg->nconns; i++) {
+            if (buffer_size(&lg->conns[i].out) > 0 && buffer_flush(&lg->conns[i].out, lg->conns[i].fd) < 0) {
+                perror("[!] write()");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        if (!sending && (lg->outstanding == 0 || now > lg->end + DRAIN_TIMEOUT * 1000000000ULL)) {
+            break;
+        }
+
+        // Sleep until the next scheduled request (or the end of the run)
+        if (sending) {
+            its.it_value.tv_sec = (lg->open_loop ? next : lg->end) / 1000000000ULL;
+            its.it_value.tv_nsec = (lg->open_loop ? next : lg->end) % 1000000000ULL;
+            timerfd_settime(lg->tfd, TFD_TIMER_ABSTIME, &its, NULL);
+        }
+
+        nfds = epoll_wait(lg->epfd, events, MAX_EVENTS, sending ? -1 : 10);
+        for (i = 0; i < nfds; i++) {
+            bc = events[i].data.ptr;
+            if (bc == NULL) { // The schedule timer expired
+                read(lg->tfd, &expirations, sizeof(expirations));
+                continue;
+            }
+            if (!(events[i].events & EPOLLIN)) {
+                continue;
+            }
+
+            // In a closed loop every response makes room for the next request
+            k = loadgen_read(lg, bc);
+            if (!lg->open_loop && sending && k > 0) {
+                now = now_ns();
+                while (k > 0) {
+                    int batch = k < window ? k : window;
+                    loadgen_send(lg, bc, batch, now, now);
+                    k -= batch;
+                }
+            }
+        }
+    }
+
+    return NULL;
+}
+
+// Results of one load generation run
+struct bench_result {
+    uint64_t sent;
+    uint64_t received;
+    uint64_t outstanding;
+    uint64_t elapsed;        // Wall time in nanoseconds
+    double cpu_user;         // Seconds of user CPU time of the client (getrusage)
+    double cpu_sys;          // Seconds of system CPU time of the client (getrusage)
+    struct hist corrected;
+    struct hist uncorrected;
+};
+
+static double timeval_sec(const struct timeval *tv) {
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+// Run the load generation threads with the current settings and merge their results
+static void bench_load_run(struct bench_result *res) {
+    int i;
+    int j;
+    char *reqs;
+    size_t req_len = bench.binary ? sizeof(struct bin_header) + bench.payload : (size_t)bench.payload + 1;
+    uint64_t start;
+    struct bin_header hdr;
+    struct loadgen *lgs;
+    struct rusage ru0;
+    struct rusage ru1;
+    struct epoll_event ev;
+
+    lgs = calloc(bench.threads, sizeof(*lgs));
+    reqs = malloc(window * req_len);
+    if (lgs == NULL || reqs == NULL) {
+        perror("[!] calloc()");
+        exit(EXIT_FAILURE);
+    }
+
+    // Every request is the same payload terminated by the null character, or behind a
+    // binary echo header tagged with its slot in the window
+    memset(reqs, 'x', window * req_len);
+    for (i = 0; i < window; i++) {
+        if (bench.binary) {
+            hdr = (struct bin_header){ BIN_MAGIC, BIN_ECHO, 0, htonl(bench.payload), htonl(i) };
+            memcpy(reqs + i * req_len, &hdr, sizeof(hdr));
+        } else {
+            reqs[(i + 1) * req_len - 1] = '\0';
+        }
+    }
+
+    for (i = 0; i < bench.threads; i++) {
+        struct loadgen *lg = &lgs[i];
+
+        lg->open_loop = strcmp(bench.mode, "open") == 0;
+        lg->rate = bench.rate / bench.threads;
+        lg->rng = 0x9E3779B97F4A7C15ULL ^ ((uint64_t)getpid() << 16) ^ (uint64_t)i;
+        lg->reqs = reqs;
+        lg->req_len = req_len;
+        lg->binary = bench.binary;
+
+        // Shard the connections: thread i owns [i * n / T, (i + 1) * n / T)
+        lg->nconns = (i + 1) * bench.conns / bench.threads - i * bench.conns / bench.threads;
+        if ((lg->conns = calloc(lg->nconns, sizeof(*lg->conns))) == NULL) {
+            perror("[!] calloc()");
+            exit(EXIT_FAILURE);
+        }
+
+        if ((lg->epfd = epoll_create(1)) == -1) {
+            perror("[!] Cannot create epoll file descriptor\n");
+            exit(EXIT_FAILURE);
+        }
+
+        // The schedule timer wakes the loop exactly when the next request is due
+        if ((lg->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) == -1) {
+            perror("[!] timerfd_create()");
+            exit(EXIT_FAILURE);
+        }
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        epoll_ctl(lg->epfd, EPOLL_CTL_ADD, lg->tfd, &ev);
+
+        for (j = 0; j < lg->nconns; j++) {
+            lg->conns[j].fd = bench_connect();
+            ev.events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP;
+            ev.data.ptr = &lg->conns[j];
+            if (epoll_ctl(lg->epfd, EPOLL_CTL_ADD, lg->conns[j].fd, &ev) == -1) {
+                perror("epoll_ctl()\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    getrusage(RUSAGE_SELF, &ru0);
+    start = now_ns();
+    for (i = 0; i < bench.threads; i++) {
+        lgs[i].start = start;
+        lgs[i].end = start + (uint64_t)bench.duration * 1000000000ULL;
+        if (pthread_create(&lgs[i].tid, NULL, loadgen_run, &lgs[i]) != 0) {
+            perror("[!] pthread_create()");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Merge the per-thread results once every thread is done
+    for (i = 0; i < bench.threads; i++) {
+        pthread_join(lgs[i].tid, NULL);
+        hist_merge(&res->corrected, &lgs[i].corrected);
+        hist_merge(&res->uncorrected, &lgs[i].uncorrected);
+        res->sent += lgs[i].sent;
+        res->received += lgs[i].received;
+        res->outstanding += lgs[i].outstanding;
+    }
+    res->elapsed = now_ns() - start;
+    getrusage(RUSAGE_SELF, &ru1);
+    res->cpu_user = timeval_sec(&ru1.ru_utime) - timeval_sec(&ru0.ru_utime);
+    res->cpu_sys = timeval_sec(&ru1.ru_stime) - timeval_sec(&ru0.ru_stime);
+
+    for (i = 0; i < bench.threads; i++) {
+        for (j = 0; j < lgs[i].nconns; j++) {
+            close(lgs[i].conns[j].fd);
+            buffer_free(&lgs[i].conns[j].out);
+            free(lgs[i].conns[j].fifo);
+        }
+        close(lgs[i].tfd);
+        close(lgs[i].epfd);
+        free(lgs[i].conns);
+    }
+    free(lgs);
+    free(reqs);
+}
+
+static struct bench_result *bench_result_new(void) {
+    struct bench_result *res;
+
+    if ((res = calloc(1, sizeof(*res))) == NULL) {
+        perror("[!] calloc()");
+        exit(EXIT_FAILURE);
+    }
+
+    return res;
+}
+
+static void bench_load() {
+    int open_loop = strcmp(bench.mode, "open") == 0;
+    struct bench_result *res = bench_result_new();
+
+    // Every thread needs at least one connection of its own
+    if (bench.conns < bench.threads) {
+        printf("[bench] raising connections to %d (one per thread)\n", bench.threads);
+        bench.conns = bench.threads;
+    }
+
+    if (open_loop) {
+        printf("[bench] open-loop %.0f req/s (%s arrivals), %d thread(s), %d connection(s), %d byte payload, %d s\n",
+               bench.rate, bench.poisson ? "poisson" : "constant", bench.threads, bench.conns, bench.payload, bench.duration);
+    } else {
+        printf("[bench] closed-loop, %d in flight per connection, %d thread(s), %d connection(s), %d byte payload, %d s\n",
+               window, bench.threads, bench.conns, bench.payload, bench.duration);
+    }
+
+    bench_load_run(res);
+
+    printf("[bench] sent %llu, received %llu, unanswered %llu\n",
+           (unsigned long long)res->sent, (unsigned long long)res->received, (unsigned long long)res->outstanding);
+    printf("[bench] achieved %.1f req/s, client cpu %.2f s user, %.2f s sys\n",
+           res->received * 1e9 / (double)res->elapsed, res->cpu_user, res->cpu_sys);
+    if (open_loop) {
+        hist_print("corrected", &res->corrected);
+        hist_print("uncorrected", &res->uncorrected);
+    } else {
+        hist_print("latency", &res->uncorrected);
+    }
+
+    if (bench.hist_file != NULL) {
+        if (hist_write(&res->corrected, bench.hist_file) < 0) {
+            perror("[!] Cannot write the histogram file");
+        } else {
+            printf("[bench] histogram written to %s\n", bench.hist_file);
+        }
+    }
+
+    free(res);
+}
+
+// Parse a comma separated list of positive integers, return the number of values or -1
+static int parse_list(const char *str, int *vals, int max) {
+    int n = 0;
+    char *end;
+    long v;
+
+    while (*str != '\0') {
+        v = strtol(str, &end, 10);
+        if (end == str || v <= 0 || v > INT32_MAX || n == max || (*end != ',' && *end != '\0')) {
+            return -1;
+        }
+
+        vals[n++] = (int)v;
+        str = *end == ',' ? end + 1 : end;
+    }
+
+    return n;
+}
+
+/*
+ * Sweep: run a closed-loop benchmark for every combination of payload size,
+ * connection count and pipeline depth, and emit one CSV row or JSON object per
+ * point so that results of different builds can be diffed.
+ */
+static void bench_sweep() {
+    int a;
+    int b;
+    int c;
+    int npayloads;
+    int nconns;
+    int nwindows;
+    int first = 1;
+    int payloads[MAX_SWEEP];
+    int conns[MAX_SWEEP];
+    int windows[MAX_SWEEP];
+    double secs;
+    FILE *fp = stdout;
+    struct bench_result *res;
+
+    npayloads = parse_list(bench.payload_list ? bench.payload_list : "16", payloads, MAX_SWEEP);
+    nconns = parse_list(bench.conns_list ? bench.conns_list : "1", conns, MAX_SWEEP);
+    nwindows = parse_list(bench.window_list ? bench.window_list : "1", windows, MAX_SWEEP);
+    if (npayloads <= 0 || nconns <= 0 || nwindows <= 0) {
+        fprintf(stderr, "[!] sweep lists take up to %d comma separated positive integers\n", MAX_SWEEP);
+        exit(EXIT_FAILURE);
+    }
+
+    if (bench.hist_file != NULL && (fp = fopen(bench.hist_file, "w")) == NULL) {
+        perror("[!] Cannot open the sweep output file");
+        exit(EXIT_FAILURE);
+    }
+
+    if (bench.json) {
+        fprintf(fp, "[\n");
+    } else {
+        fprintf(fp, "payload,connections,depth,threads,duration_s,requests,unanswered,req_per_s,"
+                    "cpu_user_s,cpu_sys_s,cpu_us_per_req,p50_us,p90_us,p99_us,p999_us,max_us\n");
+    }
+
+    for (a = 0; a < npayloads; a++) {
+        for (b = 0; b < nconns; b++) {
+            for (c = 0; c < nwindows; c++) {
+                bench.payload = payloads[a];
+                bench.conns = conns[b] < bench.threads ? bench.threads : conns[b];
+                window = windows[c];
+                if (bench.payload >= MAX_MSG) {
+                    fprintf(stderr, "[!] skipping payload %d, the limit is %d\n", bench.payload, MAX_MSG - 1);
+                    continue;
+                }
+
+                fprintf(stderr, "[bench] payload %d, %d connection(s), depth %d\n", bench.payload, bench.conns, window);
+                res = bench_result_new();
+                bench_load_run(res);
+                secs = res->elapsed / 1e9;
+
+                if (bench.json) {
+                    fprintf(fp, "%s  {\"payload\": %d, \"connections\": %d, \"depth\": %d, \"threads\": %d, "
+                                "\"duration_s\": %.3f, \"requests\": %llu, \"unanswered\": %llu, \"req_per_s\": %.1f, "
+                                "\"cpu_user_s\": %.3f, \"cpu_sys_s\": %.3f, \"cpu_us_per_req\": %.3f, "
+                                "\"p50_us\": %.1f, \"p90_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %.1f}",
+                            first ? "" : ",\n", bench.payload, bench.conns, window, bench.threads,
+                            secs, (unsigned long long)res->received, (unsigned long long)res->outstanding,
+                            res->received / secs, res->cpu_user, res->cpu_sys,
+                            res->received ? (res->cpu_user + res->cpu_sys) * 1e6 / res->received : 0.0,
+                            hist_percentile(&res->uncorrected, 50) / 1e3, hist_percentile(&res->uncorrected, 90) / 1e3,
+                            hist_percentile(&res->uncorrected, 99) / 1e3, hist_percentile(&res->uncorrected, 99.9) / 1e3,
+                            res->uncorrected.max / 1e3);
+                } else {
+                    fprintf(fp, "%d,%d,%d,%d,%.3f,%llu,%llu,%.1f,%.3f,%.3f,%.3f,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+                            bench.payload, bench.conns, window, bench.threads,
+                            secs, (unsigned long long)res->received, (unsigned long long)res->outstanding,
+                            res->received / secs, res->cpu_user, res->cpu_sys,
+                            res->received ? (res->cpu_user + res->cpu_sys) * 1e6 / res->received : 0.0,
+                            hist_percentile(&res->uncorrected, 50) / 1e3, hist_percentile(&res->uncorrected, 90) / 1e3,
+                            hist_percentile(&res->uncorrected, 99) / 1e3, hist_percentile(&res->uncorrected, 99.9) / 1e3,
+                            res->uncorrected.max / 1e3);
+                }
+                fflush(fp);
+                first = 0;
+                free(res);
+            }
+        }
+    }
+
+    if (bench.json) {
+        fprintf(fp, "\n]\n");
+    }
+    if (fp != stdout) {
+        fclose(fp);
+    }
+}
+
+// Read a TcpExt counter (e.g. ListenOverflows) from /proc/net/netstat, -1 if unavailable
+static long long read_tcpext(const char *name) {
+    char names[4096];
+    char values[4096];
+    char *n;
+    char *v;
+    char *nsave;
+    char *vsave;
+    long long res = -1;
+    FILE *fp;
+
+    if ((fp = fopen("/proc/net/netstat", "r")) == NULL) {
+        return -1;
+    }
+
+    // The file is made of header/value line pairs, one pair per counter group
+    while (fgets(names, sizeof(names), fp) != NULL && fgets(values, sizeof(values), fp) != NULL) {
+        if (strncmp(names, "TcpExt:", 7) != 0) {
+            continue;
+        }
+
+        n = strtok_r(names, " \n", &nsave);
+        v = strtok_r(values, " \n", &vsave);
+        while ((n = strtok_r(NULL, " \n", &nsave)) != NULL && (v = strtok_r(NULL, " \n", &vsave)) != NULL) {
+            if (strcmp(n, name) == 0) {
+                res = atoll(v);
+                break;
+            }
+        }
+        break;
+    }
+
+    fclose(fp);
+    return res;
+}
+
+/*
+ * Connection churn: every thread repeatedly connects, sends one %time%
+ * request, reads the reply and closes, until the duration is over.
+ */
+struct churn_thread {
+    pthread_t tid;
+    uint64_t deadline;
+    uint64_t conns;
+    uint64_t errors;
+    struct hist connect_lat; // socket() + connect()
+    struct hist txn_lat;     // connect to reply received
+};
+
+static void *churn_thread_run(void *arg) {
+    int fd;
+    int n;
+    int got;
+    char buf[MAX_LINE];
+    uint64_t t0;
+    uint64_t t1;
+    struct churn_thread *ct = arg;
+    struct sockaddr_in srv_addr;
+
+    set_sockaddr(&srv_addr);
+
+    while ((t0 = now_ns()) < ct->deadline) {
+        if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+            ct->errors++;
+            continue;
+        }
+
+        if (connect(fd, (struct sockaddr *)&srv_addr, sizeof(srv_addr)) < 0) {
+            ct->errors++;
+            close(fd);
+            continue;
+        }
+        t1 = now_ns();
+
+        // One request, then wait for its terminator
+        got = 0;
+        if (write(fd, "%time%", 7) == 7) {
+            while (!got && (n = read(fd, buf, sizeof(buf))) > 0) {
+                got = memchr(buf, '\0', n) != NULL;
+            }
+        }
+        close(fd);
+
+        if (!got) {
+            ct->errors++;
+            continue;
+        }
+
+        hist_record(&ct->connect_lat, t1 - t0);
+        hist_record(&ct->txn_lat, now_ns() - t0);
+        ct->conns++;
+    }
+
+    return NULL;
+}
+
+static void bench_churn() {
+    int i;
+    uint64_t start;
+    uint64_t elapsed;
+    uint64_t conns = 0;
+    uint64_t errors = 0;
+    long long overflows;
+    long long drops;
+    struct churn_thread *cts;
+    struct hist *connect_lat;
+    struct hist *txn_lat;
+
+    cts = calloc(bench.threads, sizeof(*cts));
+    connect_lat = calloc(1, sizeof(*connect_lat));
+    txn_lat = calloc(1, sizeof(*txn_lat));
+    if (cts == NULL || connect_lat == NULL || txn_lat == NULL) {
+        perror("[!] calloc()");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("[bench] connection churn, %d thread(s), %d s\n", bench.threads, bench.duration);
+
+    // Accept queue overflows are only visible in the kernel counters (of the whole host)
+    overflows = read_tcpext("ListenOverflows");
+    drops = read_tcpext("ListenDrops");
+
+    start = now_ns();
+    for (i = 0; i < bench.threads; i++) {
+        cts[i].deadline = start + (uint64_t)bench.duration * 1000000000ULL;
+        if (pthread_create(&cts[i].tid, NULL, churn_thread_run, &cts[i]) != 0) {
+            perror("[!] pthread_create()");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (i = 0; i < bench.threads; i++) {
+        pthread_join(cts[i].tid, NULL);
+        hist_merge(connect_lat, &cts[i].connect_lat);
+        hist_merge(txn_lat, &cts[i].txn_lat);
+        conns += cts[i].conns;
+        errors += cts[i].errors;
+    }
+    elapsed = now_ns() - start;
+
+    printf("[bench] connections %llu, errors %llu\n", (unsigned long long)conns, (unsigned long long)errors);
+    printf("[bench] achieved %.1f conn/s\n", conns * 1e9 / (double)elapsed);
+    hist_print("connect", connect_lat);
+    hist_print("transaction", txn_lat);
+
+    if (overflows >= 0 && drops >= 0) {
+        printf("[bench] listen queue overflows %lld, listen drops %lld (TcpExt, host wide)\n",
+               read_tcpext("ListenOverflows") - overflows, read_tcpext("ListenDrops") - drops);
+    } else {
+        printf("[bench] listen queue counters unavailable (/proc/net/netstat)\n");
+    }
+
+    if (bench.hist_file != NULL) {
+        if (hist_write(connect_lat, bench.hist_file) < 0) {
+            perror("[!] Cannot write the histogram file");
+        } else {
+            printf("[bench] connect latency histogram written to %s\n", bench.hist_file);
+        }
+    }
+
+    free(cts);
+    free(connect_lat);
+    free(txn_lat);
+}
+
+void bench_run() {
+    if (strcmp(bench.mode, "churn") == 0) {
+        bench_churn();
+    } else if (strcmp(bench.mode, "sweep") == 0) {
+        bench_sweep();
+    } else {
+        bench_load();
+    }
 }
@@ -0,0 +1,58 @@
+/*
+ * Binary event trace of the server (built with -DEPOLL_TRACE, enabled with --trace).
+ *
+ * Every worker maps its own file, PATH.<worker>: a header followed by a ring of
+ * fixed-size records. The worker only ever appends; `head` counts the records
+ * written so far, so the ring holds the last min(head, capacity) of them and the
+ * file can be read while the server is running or after it crashed.
+ * trace2json converts the files to the Chrome trace event format.
+ */
+#ifndef EPOLL_TRACE_H
+#define EPOLL_TRACE_H
+
+#include <stdint.h>
+
+#define TRACE_MAGIC   "EPTRACE1"
+#define TRACE_VERSION 1
+
+// Record types; *_BEGIN/*_END pairs are spans, the others instants
+#define TRACE_WAIT_BEGIN     0 // The worker blocks in the reactor
+#define TRACE_WAIT_END       1 // arg: events returned
+#define TRACE_ACCEPT         2 // A new connection on this worker
+#define TRACE_READ_BEGIN     3
+#define TRACE_READ_END       4 // arg: bytes read, 0 on EOF, EAGAIN or an error
+#define TRACE_DISPATCH_BEGIN 5
+#define TRACE_DISPATCH_END   6 // arg: request type (CMD_* in epoll.c)
+#define TRACE_WRITE_BEGIN    7 // arg: bytes pending
+#define TRACE_WRITE_END      8 // arg: bytes pending afterwards
+#define TRACE_CLOSE          9
+#define TRACE_RECV           10 // arg: bytes received by the io_uring-fixed reactor
+#define TRACE_TYPES          11
+
+static const char *const trace_names[TRACE_TYPES] = {
+    "wait", "wait", "accept", "read", "read", "dispatch", "dispatch", "write", "write", "close", "recv"
+};
+
+// Chrome trace phase of each type: B(egin), E(nd) or i(nstant)
+static const char trace_phases[TRACE_TYPES] = {
+    'B', 'E', 'i', 'B', 'E', 'B', 'E', 'B', 'E', 'i', 'i'
+};
+
+struct trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t worker;
+    uint64_t capacity;  // Records in the ring, a power of two
+    uint64_t tsc_hz;    // Timestamp ticks per second
+    uint64_t head;      // Records written, updated with a release store after each record
+    uint64_t pad[3];    // The records start on a cache line
+};
+
+struct trace_record {
+    uint64_t tsc;       // Time stamp counter (CLOCK_MONOTONIC nanoseconds where there is none)
+    uint32_t type;
+    int32_t fd;
+    uint64_t arg;
+};
+
+#endif
@@ -0,0 +1,128 @@
+/*
+ * Convert the trace files of an `epoll -s --trace PATH` server (PATH.0, PATH.1, ...)
+ * to the Chrome trace event format, for chrome://tracing or https://ui.perfetto.dev.
+ *
+ *     trace2json PATH.0 PATH.1 ... > trace.json
+ *
+ * Every worker becomes a thread of one process. Timestamps are microseconds since
+ * the earliest record of all files.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "trace.h"
+
+struct trace_file {
+    const char *path;
+    struct trace_header hdr;
+    struct trace_record *recs; // Oldest first
+    uint64_t n;
+};
+
+// Read a trace file and put its ring in order, return -1 if it is not one
+static int trace_load(struct trace_file *t, const char *path) {
+    FILE *fp;
+    uint64_t i;
+    uint64_t first;
+    struct trace_record *ring;
+
+    t->path = path;
+    if ((fp = fopen(path, "rb")) == NULL) {
+        perror(path);
+        return -1;
+    }
+    if (fread(&t->hdr, sizeof(t->hdr), 1, fp) != 1 || memcmp(t->hdr.magic, TRACE_MAGIC, sizeof(t->hdr.magic)) != 0 ||
+        t->hdr.version != TRACE_VERSION || t->hdr.capacity == 0 || (t->hdr.capacity & (t->hdr.capacity - 1)) != 0) {
+        fprintf(stderr, "%s: not a trace file\n", path);
+        fclose(fp);
+        return -1;
+    }
+
+    if ((ring = malloc(t->hdr.capacity * sizeof(*ring))) == NULL ||
+        fread(ring, sizeof(*ring), t->hdr.capacity, fp) != t->hdr.capacity) {
+        fprintf(stderr, "%s: truncated\n", path);
+        free(ring);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+
+    // Once the ring has wrapped, the oldest record is the one after the newest
+    t->n = t->hdr.head < t->hdr.capacity ? t->hdr.head : t->hdr.capacity;
+    first = t->hdr.head - t->n;
+    if ((t->recs = malloc(t->n * sizeof(*t->recs) + 1)) == NULL) {
+        perror("malloc()");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < t->n; i++) {
+        t->recs[i] = ring[(first + i) & (t->hdr.capacity - 1)];
+    }
+    free(ring);
+
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int i;
+    int nfiles = 0;
+    int sep = 0;
+    uint64_t k;
+    uint64_t base = UINT64_MAX;
+    struct trace_file *files;
+    struct trace_record *r;
+    struct trace_file *t;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s trace.0 [trace.1 ...] > trace.json\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if ((files = calloc(argc - 1, sizeof(*files))) == NULL) {
+        perror("calloc()");
+        return EXIT_FAILURE;
+    }
+    for (i = 1; i < argc; i++) {
+        if (trace_load(&files[nfiles], argv[i]) == 0) {
+            nfiles++;
+        }
+    }
+
+    for (i = 0; i < nfiles; i++) {
+        if (files[i].n > 0 && files[i].recs[0].tsc < base) {
+            base = files[i].recs[0].tsc;
+        }
+    }
+
+    printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    for (i = 0; i < nfiles; i++) {
+        t = &files[i];
+        printf("%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"worker %u\"}}",
+               sep++ ? ",\n" : "", t->hdr.worker, t->hdr.worker);
+
+        for (k = 0; k < t->n; k++) {
+            r = &t->recs[k];
+            if (r->type >= TRACE_TYPES) {
+                continue;
+            }
+
+            printf(",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%u",
+                   trace_names[r->type], trace_phases[r->type],
+                   (double)(r->tsc - base) * 1e6 / t->hdr.tsc_hz, t->hdr.worker);
+            if (trace_phases[r->type] == 'i') {
+                printf(",\"s\":\"t\"");
+            }
+            if (r->fd >= 0) {
+                printf(",\"args\":{\"fd\":%d,\"arg\":%lu}}", r->fd, (unsigned long)r->arg);
+            } else {
+                printf(",\"args\":{\"arg\":%lu}}", (unsigned long)r->arg);
+            }
+        }
+        free(t->recs);
+    }
+    printf("\n]}\n");
+
+    free(files);
+    return nfiles == argc - 1 ? EXIT_SUCCESS : EXIT_FAILURE;
+}